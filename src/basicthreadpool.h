@@ -0,0 +1,273 @@
+/**
+ * A thread pool framework
+ * Copyright 2017 (c), Oshyn Song (dualyangsong@gmail.com)
+ *
+ * @file    basicthreadpool.h
+ * @author  Oshyn Song
+ * @time    2017.8
+ */
+#ifndef THREADPOOL_BASICTHREADPOOL_H
+#define THREADPOOL_BASICTHREADPOOL_H
+
+#include <pthread.h>
+
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "common.h"
+#include "util.h"
+#include "task.h"
+#include "context.h"
+#include "trace.h"
+#include "taskstats.h"
+#include "policy.h"
+#include "threadpool.h"
+
+BEGIN_NAMESPACE
+
+/**
+ * Thread pool whose queue, idle strategy and capacities are fixed at compile
+ * time. The workers take the tasks from the queue by themselves, so there is
+ * no dispatcher, no Worker object and no virtual call but Task::run.
+ *
+ * Several pools of different types and limits can live in one process, the
+ * g_threadpool_* globals are not used.
+ */
+template <typename QueuePolicy = FifoPolicy,
+          typename WaitPolicy  = BlockingWait,
+          typename Capacity    = FixedCapacity<4, 1024>>
+class BasicThreadPool {
+public:
+    typedef typename QueuePolicy::template queue_type<Capacity::max_tasks> queue_type;
+
+    BasicThreadPool();
+    ~BasicThreadPool();
+
+    // No copying
+    BasicThreadPool(const BasicThreadPool &) = delete;
+    BasicThreadPool &operator=(const BasicThreadPool &) = delete;
+
+    // The task is deleted after running if need_clear
+    bool add_task(Task *task, void *arg=nullptr, bool need_clear=false);
+
+    // The workers dispatch by themselves, just wait for the added tasks
+    void run();
+
+    // Same as ThreadPool::shutdown
+    ThreadPool::ShutdownReport shutdown(ThreadPool::ShutdownMode mode=ThreadPool::DRAIN,
+            unsigned long long timeout_ms=0);
+    bool is_shutdown() const { return _shutdown.load(); }
+
+    size_t get_thread_num() const { return Capacity::threads; }
+    size_t get_task_num() const { return _state->queue.size(); }
+
+private:
+    // Shared with the workers, kept alive by the hung ones after shutdown
+    struct State {
+        State() : stop(false), unfinished(0) {}
+
+        queue_type          queue;
+        WaitPolicy          idle;
+        BlockingWait        done;
+        std::atomic<bool>   stop;
+        std::atomic<size_t> unfinished;
+    };
+
+    struct WorkerArg {
+        std::shared_ptr<State> state;
+        size_t                 index;
+    };
+
+    static void *worker_function(void *);
+    static void worker_loop(State &state, size_t index);
+
+    void stop_workers();
+    void take_unrun(ThreadPool::ShutdownReport &report);
+
+    std::shared_ptr<State> _state;
+    pthread_t              _threads[Capacity::threads];
+    bool                   _started[Capacity::threads];
+    std::vector<TaskEntry> _unrun;
+    std::atomic<bool>      _shutdown;
+};
+
+template <typename Q, typename W, typename C>
+BasicThreadPool<Q, W, C>::BasicThreadPool()
+    : _state(std::make_shared<State>()), _unrun(), _shutdown(false)
+{
+    for (size_t i = 0; i < C::threads; ++i) {
+        _started[i] = false;
+    }
+
+    for (size_t i = 0; i < C::threads; ++i) {
+        WorkerArg *arg = new WorkerArg{_state, i};
+        if (0 != pthread_create(&_threads[i], nullptr, worker_function, arg)) {
+            delete arg;
+            stop_workers();
+            throw std::runtime_error("Failed to start the pool threads!");
+        }
+        _started[i] = true;
+    }
+}
+
+template <typename Q, typename W, typename C>
+BasicThreadPool<Q, W, C>::~BasicThreadPool()
+{
+    shutdown(ThreadPool::DISCARD);
+    for (auto &entry : _unrun) {
+        if (entry.need_clear) {
+            delete entry.task;
+        }
+    }
+    _unrun.clear();
+}
+
+template <typename Q, typename W, typename C>
+bool BasicThreadPool<Q, W, C>::add_task(Task *task, void *arg, bool need_clear)
+{
+    if (task == nullptr || _shutdown.load(std::memory_order_relaxed)) {
+        return false;
+    }
+
+    // Counted before pushing, it may finish right after
+    State &state = *_state;
+    ++state.unfinished;
+    trace_event(Tracer::ENQUEUE, task, -1);
+    stats_enqueue(task);
+    if (!state.queue.push(TaskEntry{task, arg, need_clear})) {
+        --state.unfinished;
+        stats_reject(task);
+        return false;
+    }
+    state.idle.notify_one();
+    return true;
+}
+
+template <typename Q, typename W, typename C>
+void BasicThreadPool<Q, W, C>::run()
+{
+    State &state = *_state;
+    state.done.wait([&state]() -> bool { return state.unfinished.load() == 0; });
+}
+
+template <typename Q, typename W, typename C>
+ThreadPool::ShutdownReport BasicThreadPool<Q, W, C>::shutdown(ThreadPool::ShutdownMode mode,
+        unsigned long long timeout_ms)
+{
+    ThreadPool::ShutdownReport report;
+    report.joined_threads = 0;
+    report.hung_threads   = 0;
+    if (_shutdown.exchange(true)) {
+        return report;
+    }
+
+    // The workers exit once the queue is empty, so discard it before stopping
+    if (mode == ThreadPool::DISCARD) {
+        take_unrun(report);
+    }
+    _state->stop.store(true);
+    _state->idle.notify_all();
+
+    struct timespec deadline = make_deadline(timeout_ms);
+    for (size_t i = 0; i < C::threads; ++i) {
+        if (!_started[i]) {
+            continue;
+        }
+        int status = (timeout_ms > 0) ? pthread_timedjoin_np(_threads[i], nullptr, &deadline)
+                                      : pthread_join(_threads[i], nullptr);
+        _started[i] = false;
+        if (status == 0) {
+            ++report.joined_threads;
+        } else {
+            pthread_detach(_threads[i]);
+            ++report.hung_threads;
+        }
+    }
+
+    // Still queued after the deadline
+    take_unrun(report);
+    return report;
+}
+
+template <typename Q, typename W, typename C>
+void *BasicThreadPool<Q, W, C>::worker_function(void *arg)
+{
+    WorkerArg *worker = static_cast<WorkerArg *>(arg);
+    std::shared_ptr<State> state(worker->state);
+    size_t index = worker->index;
+    delete worker;
+
+    worker_loop(*state, index);
+    return nullptr;
+}
+
+template <typename Q, typename W, typename C>
+void BasicThreadPool<Q, W, C>::worker_loop(State &state, size_t index)
+{
+    WorkerContext context(index);
+    WorkerContext::set_current(&context);
+
+    long trace_index = static_cast<long>(index);
+    TaskEntry entry;
+    while (true) {
+        bool popped = false;
+        state.idle.wait([&]() -> bool {
+            popped = state.queue.pop(entry);
+            return popped || state.stop.load();
+        });
+        if (!popped) {
+            break;
+        }
+
+        trace_event(Tracer::DISPATCH, entry.task, trace_index);
+        trace_event(Tracer::START, entry.task, trace_index);
+        TaskStats::Sample sample;
+        bool measured = stats_begin(entry.task, &sample);
+        entry.task->run(entry.arg);
+        if (measured) {
+            TaskStats::end(sample);
+        }
+        trace_finish(trace_index);
+        context.get_arena().reset();
+        if (entry.need_clear) {
+            delete entry.task;
+        }
+
+        if (--state.unfinished == 0) {
+            state.done.notify_all();
+        }
+    }
+    WorkerContext::set_current(nullptr);
+}
+
+template <typename Q, typename W, typename C>
+void BasicThreadPool<Q, W, C>::stop_workers()
+{
+    _state->stop.store(true);
+    _state->idle.notify_all();
+    for (size_t i = 0; i < C::threads; ++i) {
+        if (_started[i]) {
+            pthread_join(_threads[i], nullptr);
+            _started[i] = false;
+        }
+    }
+}
+
+template <typename Q, typename W, typename C>
+void BasicThreadPool<Q, W, C>::take_unrun(ThreadPool::ShutdownReport &report)
+{
+    TaskEntry entry;
+    while (_state->queue.pop(entry)) {
+        report.unrun_tasks.push_back(entry.task);
+        _unrun.push_back(entry);
+        if (--_state->unfinished == 0) {
+            _state->done.notify_all();
+        }
+    }
+}
+
+END_NAMESPACE
+#endif
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,270 @@
+/**
+ * A thread pool framework
+ * Copyright 2017 (c), Oshyn Song (dualyangsong@gmail.com)
+ *
+ * @file    blockingexecutor.cpp
+ * @author  Oshyn Song
+ * @time    2017.8
+ */
+#include "blockingexecutor.h"
+#include "task.h"
+#include "taskstats.h"
+#include "probes.h"
+
+#include <algorithm>
+
+BEGIN_NAMESPACE
+
+// Runs the tasks until being idle for the keepalive, then exits
+class BlockingExecutor::BlockingThread : public Thread {
+public:
+    explicit BlockingThread(const std::shared_ptr<BlockingExecutor::State> &state)
+        : Thread(false, false, "BlockingThread"), _state(state)
+    {
+        // Nothing to do
+    }
+
+    void run() override
+    {
+        TaskEntry entry;
+        while (_state->next_task(this, &entry)) {
+            entry.task->set_executor(this);
+            TaskStats::Sample sample;
+            bool measured = stats_begin(entry.task, &sample);
+            entry.task->run(entry.arg);
+            if (measured) {
+                TaskStats::end(sample);
+            }
+            if (entry.need_clear) {
+                delete entry.task;
+            }
+        }
+
+        // Exit instead of suspending
+        request_stop();
+    }
+
+private:
+    std::shared_ptr<BlockingExecutor::State> _state;
+};
+
+BlockingExecutor::State::State(size_t max_threads, size_t max_tasks,
+        unsigned long long keepalive)
+    : tasks(), threads(), exited(), idle_num(0), max_thread_num(max_threads),
+      max_task_num(max_tasks), keepalive_ms(keepalive), stack(), stopping(false),
+      mutex("BlockingExecutor"), cond(&mutex)
+{
+    // Nothing to do
+}
+
+// Destructed by the executor or the last hung thread, whichever is later
+BlockingExecutor::State::~State()
+{
+    for (auto task : dropped) {
+        delete task;
+    }
+    dropped.clear();
+}
+
+// Called with the lock, the tasks to clear are kept until the state is gone
+void BlockingExecutor::State::drop_tasks(std::vector<Task*> *unrun_tasks)
+{
+    for (auto &entry : tasks) {
+        unrun_tasks->push_back(entry.task);
+        if (entry.need_clear) {
+            dropped.push_back(entry.task);
+        }
+    }
+    tasks.clear();
+}
+
+BlockingExecutor::BlockingExecutor(size_t max_threads, size_t max_tasks,
+        unsigned long long keepalive_ms)
+    : _state(std::make_shared<State>(max_threads, max_tasks, keepalive_ms))
+{
+    // Nothing to do
+}
+
+BlockingExecutor::~BlockingExecutor()
+{
+    std::vector<Task*> unrun;
+    shutdown(false, nullptr, &unrun);
+}
+
+bool BlockingExecutor::add_task(Task *task, void *arg, bool need_clear)
+{
+    if (task == nullptr) {
+        return false;
+    }
+
+    State &state = *_state;
+    state.mutex.lock();
+    if (state.stopping || state.tasks.size() >= state.max_task_num) {
+        if (!state.stopping) {
+            TP_PROBE3(task__reject, this, task, state.max_task_num);
+            stats_reject(task);
+        }
+        state.mutex.unlock();
+        return false;
+    }
+    state.tasks.push_back(TaskEntry{task, arg, need_clear});
+
+    if (state.idle_num > 0) {
+        state.cond.signal();
+    } else if (state.threads.size() < state.max_thread_num) {
+        BlockingThread *thread = new BlockingThread(_state);
+        thread->set_stack(state.stack);
+        if (thread->start()) {
+            state.threads.push_back(thread);
+        } else {
+            delete thread;
+        }
+    }
+
+    // Still queued for the running threads if no thread could be added
+    bool accepted = !state.threads.empty();
+    if (!accepted) {
+        state.tasks.pop_back();
+    }
+    bool reaping = !state.exited.empty();
+    state.mutex.unlock();
+
+    if (reaping) {
+        reap();
+    }
+    return accepted;
+}
+
+void BlockingExecutor::set_limits(size_t max_threads, size_t max_tasks,
+        unsigned long long keepalive_ms)
+{
+    _state->mutex.lock();
+    _state->max_thread_num = max_threads;
+    _state->max_task_num   = max_tasks;
+    _state->keepalive_ms   = keepalive_ms;
+    _state->mutex.unlock();
+}
+
+void BlockingExecutor::set_stack(const StackConfig &stack)
+{
+    _state->mutex.lock();
+    _state->stack = stack;
+    _state->mutex.unlock();
+}
+
+size_t BlockingExecutor::shutdown(bool drain, const struct timespec *deadline,
+        std::vector<Task*> *unrun_tasks)
+{
+    request_shutdown(drain, unrun_tasks);
+    return join_threads(deadline, unrun_tasks);
+}
+
+void BlockingExecutor::request_shutdown(bool drain, std::vector<Task*> *unrun_tasks)
+{
+    State &state = *_state;
+    state.mutex.lock();
+    state.stopping = true;
+    if (!drain) {
+        state.drop_tasks(unrun_tasks);
+    }
+    state.cond.broadcast();
+    state.mutex.unlock();
+}
+
+// The queued tasks are run before the threads exit
+size_t BlockingExecutor::join_threads(const struct timespec *deadline,
+        std::vector<Task*> *unrun_tasks)
+{
+    State &state = *_state;
+    state.mutex.lock();
+    std::vector<BlockingThread*> threads;
+    threads.swap(state.threads);
+    threads.insert(threads.end(), state.exited.begin(), state.exited.end());
+    state.exited.clear();
+    state.mutex.unlock();
+
+    size_t hung = 0;
+    for (auto thread : threads) {
+        if (deadline ? thread->join(*deadline) : thread->join()) {
+            delete thread;
+            continue;
+        }
+        // Leave the hung thread alone, its object and the state it shares
+        // must be kept alive
+        thread->detach();
+        ++hung;
+    }
+
+    state.mutex.lock();
+    state.drop_tasks(unrun_tasks);
+    state.mutex.unlock();
+    return hung;
+}
+
+size_t BlockingExecutor::get_thread_num() const
+{
+    _state->mutex.lock();
+    size_t num = _state->threads.size();
+    _state->mutex.unlock();
+    return num;
+}
+
+size_t BlockingExecutor::get_idle_thread_num() const
+{
+    _state->mutex.lock();
+    size_t num = _state->idle_num;
+    _state->mutex.unlock();
+    return num;
+}
+
+size_t BlockingExecutor::get_task_num() const
+{
+    _state->mutex.lock();
+    size_t num = _state->tasks.size();
+    _state->mutex.unlock();
+    return num;
+}
+
+// Return false if the thread should exit, it is then joined by reap()
+bool BlockingExecutor::State::next_task(BlockingThread *thread, TaskEntry *entry)
+{
+    mutex.lock();
+    while (tasks.empty()) {
+        if (stopping) {
+            mutex.unlock();
+            return false;
+        }
+
+        ++idle_num;
+        bool signaled = cond.wait(make_deadline(keepalive_ms));
+        --idle_num;
+        if (!signaled && tasks.empty() && !stopping) {
+            threads.erase(std::find(threads.begin(), threads.end(), thread));
+            exited.push_back(thread);
+            mutex.unlock();
+            return false;
+        }
+    }
+
+    *entry = tasks.front();
+    tasks.pop_front();
+    mutex.unlock();
+    return true;
+}
+
+// Join the threads exited by the keepalive
+void BlockingExecutor::reap()
+{
+    _state->mutex.lock();
+    std::vector<BlockingThread*> exited;
+    exited.swap(_state->exited);
+    _state->mutex.unlock();
+
+    for (auto thread : exited) {
+        thread->join();
+        delete thread;
+    }
+}
+
+END_NAMESPACE
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,92 @@
+/**
+ * A thread pool framework
+ * Copyright 2017 (c), Oshyn Song (dualyangsong@gmail.com)
+ *
+ * @file    blockingexecutor.h
+ * @author  Oshyn Song
+ * @time    2017.8
+ */
+#ifndef THREADPOOL_BLOCKINGEXECUTOR_H
+#define THREADPOOL_BLOCKINGEXECUTOR_H
+
+#include <time.h>
+
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include "common.h"
+#include "util.h"
+#include "thread.h"
+#include "policy.h"
+
+BEGIN_NAMESPACE
+
+/**
+ * Elastic threads for the blocking tasks, e.g. file or syscall-heavy ones,
+ * with a queue and limits of their own. A thread is added when a task is
+ * queued and none is idle, and exits after being idle for the keepalive.
+ */
+class BlockingExecutor {
+public:
+    BlockingExecutor(size_t max_threads, size_t max_tasks, unsigned long long keepalive_ms);
+
+    // Discard the queued tasks and wait for the running ones
+    ~BlockingExecutor();
+
+    // No copying
+    BlockingExecutor(const BlockingExecutor &) = delete;
+    BlockingExecutor &operator=(const BlockingExecutor &) = delete;
+
+    bool add_task(Task *, void *arg=nullptr, bool need_clear=false);
+
+    // Affect the threads added later
+    void set_limits(size_t max_threads, size_t max_tasks, unsigned long long keepalive_ms);
+    void set_stack(const StackConfig &stack);
+
+    // Stop accepting tasks, run or give the queued ones to unrun_tasks, and
+    // join the threads before the deadline if any. Return the hung threads.
+    // The unrun tasks are still owned by the executor if need_clear.
+    size_t shutdown(bool drain, const struct timespec *deadline, std::vector<Task*> *unrun_tasks);
+
+    // The two halves of shutdown(), to stop other threads in between
+    void request_shutdown(bool drain, std::vector<Task*> *unrun_tasks);
+    size_t join_threads(const struct timespec *deadline, std::vector<Task*> *unrun_tasks);
+
+    size_t get_thread_num() const;
+    size_t get_idle_thread_num() const;
+    size_t get_task_num() const;
+
+private:
+    class BlockingThread;
+
+    // Shared with the threads, kept alive by the hung ones after shutdown
+    struct State {
+        State(size_t max_threads, size_t max_tasks, unsigned long long keepalive_ms);
+        ~State();
+
+        bool next_task(BlockingThread *, TaskEntry *);
+        void drop_tasks(std::vector<Task*> *unrun_tasks);
+
+        std::deque<TaskEntry>         tasks;
+        std::vector<Task*>            dropped;  // Never run and need_clear, freed with the state
+        std::vector<BlockingThread*>  threads;
+        std::vector<BlockingThread*>  exited;
+        size_t                        idle_num;
+        size_t                        max_thread_num;
+        size_t                        max_task_num;
+        unsigned long long            keepalive_ms;
+        StackConfig                   stack;
+        bool                          stopping;
+        Mutex                         mutex;
+        Condition                     cond;
+    };
+
+    void reap();
+
+    std::shared_ptr<State> _state;
+};
+
+END_NAMESPACE
+#endif
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
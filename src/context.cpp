@@ -0,0 +1,120 @@
+/**
+ * A thread pool framework
+ * Copyright 2017 (c), Oshyn Song (dualyangsong@gmail.com)
+ *
+ * @file    context.cpp
+ * @author  Oshyn Song
+ * @time    2017.8
+ */
+#include "context.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+BEGIN_NAMESPACE
+
+// Definition of class Arena
+Arena::Arena(size_t block_size) : _head(nullptr), _cur(nullptr), _end(nullptr),
+    _block_size(block_size), _used(0), _reserved(0)
+{
+    // Allocate lazily, the worker may never need it
+}
+
+Arena::~Arena()
+{
+    free_blocks();
+}
+
+void *Arena::allocate(size_t size, size_t align)
+{
+    uintptr_t pos = reinterpret_cast<uintptr_t>(_cur);
+    uintptr_t aligned = (pos + align - 1) & ~(static_cast<uintptr_t>(align) - 1);
+    if (_cur == nullptr || aligned + size > reinterpret_cast<uintptr_t>(_end)) {
+        add_block(size + align > _block_size ? size + align : _block_size);
+        pos = reinterpret_cast<uintptr_t>(_cur);
+        aligned = (pos + align - 1) & ~(static_cast<uintptr_t>(align) - 1);
+    }
+
+    _cur = reinterpret_cast<char *>(aligned + size);
+    _used += size;
+    return reinterpret_cast<void *>(aligned);
+}
+
+void Arena::reset()
+{
+    if (_head != nullptr && _head->next != nullptr) {
+        // Merge the blocks into one which can hold all of them
+        size_t total = _reserved;
+        free_blocks();
+        add_block(total);
+    }
+    if (_head != nullptr) {
+        _cur = reinterpret_cast<char *>(_head + 1);
+    }
+    _used = 0;
+}
+
+void Arena::add_block(size_t size)
+{
+    Block *block = static_cast<Block *>(std::malloc(sizeof(Block) + size));
+    if (block == nullptr) {
+        throw std::bad_alloc();
+    }
+    block->next = _head;
+    block->size = size;
+    _head = block;
+    _cur  = reinterpret_cast<char *>(block + 1);
+    _end  = _cur + size;
+    _reserved += size;
+}
+
+void Arena::free_blocks()
+{
+    while (_head != nullptr) {
+        Block *next = _head->next;
+        std::free(_head);
+        _head = next;
+    }
+    _cur = _end = nullptr;
+    _reserved = 0;
+}
+
+// Definition of class WorkerContext
+static thread_local WorkerContext *s_current_context = nullptr;
+
+WorkerContext::WorkerContext(size_t index) : _index(index), _owner(nullptr), _arena(), _slots()
+{
+    // Nothing to do
+}
+
+WorkerContext::~WorkerContext()
+{
+    for (auto &slot : _slots) {
+        if (slot.ptr != nullptr) {
+            slot.deleter(slot.ptr);
+            slot.ptr = nullptr;
+        }
+    }
+    _slots.clear();
+}
+
+WorkerContext *WorkerContext::current()
+{
+    return s_current_context;
+}
+
+void WorkerContext::set_current(WorkerContext *context)
+{
+    s_current_context = context;
+}
+
+size_t WorkerContext::next_slot_id()
+{
+    static std::atomic<size_t> s_slot_num(0);
+    return s_slot_num++;
+}
+
+END_NAMESPACE
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
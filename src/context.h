@@ -0,0 +1,137 @@
+/**
+ * A thread pool framework
+ * Copyright 2017 (c), Oshyn Song (dualyangsong@gmail.com)
+ *
+ * @file    context.h
+ * @author  Oshyn Song
+ * @time    2017.8
+ */
+#ifndef THREADPOOL_CONTEXT_H
+#define THREADPOOL_CONTEXT_H
+
+#include <cstddef>
+#include <vector>
+
+#include "common.h"
+
+BEGIN_NAMESPACE
+
+/**
+ * Bump allocator for the scratch memory of tasks, nothing is freed one by
+ * one but all at once by reset()
+ */
+class Arena {
+public:
+    explicit Arena(size_t block_size = 64 * 1024);
+    ~Arena();
+
+    // No copying
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    void *allocate(size_t size, size_t align = alignof(std::max_align_t));
+
+    template <typename T>
+    T *allocate_array(size_t num)
+    {
+        return static_cast<T *>(allocate(sizeof(T) * num, alignof(T)));
+    }
+
+    // Recycle all the allocated memory, the blocks are merged into one
+    // so that the same usage fits without malloc next time
+    void reset();
+
+    size_t get_used_size() const { return _used; }
+    size_t get_reserved_size() const { return _reserved; }
+
+private:
+    struct Block {
+        Block *next;
+        size_t size;
+    };
+
+    void add_block(size_t size);
+    void free_blocks();
+
+    Block * _head;
+    char *  _cur;
+    char *  _end;
+    size_t  _block_size;
+    size_t  _used;
+    size_t  _reserved;
+};
+
+/**
+ * Context owned by a worker and reachable by the tasks it runs
+ */
+class WorkerContext {
+public:
+    explicit WorkerContext(size_t index = 0);
+    ~WorkerContext();
+
+    // No copying
+    WorkerContext(const WorkerContext &) = delete;
+    WorkerContext &operator=(const WorkerContext &) = delete;
+
+    size_t get_index() const { return _index; }
+    void set_index(size_t index) { _index = index; }
+
+    // The pool the worker belongs to
+    const void *get_owner() const { return _owner; }
+    void set_owner(const void *owner) { _owner = owner; }
+
+    // Reset by the worker after each task
+    Arena &get_arena() { return _arena; }
+
+    // Worker-local object of type T, default constructed on the first use
+    // and destructed with the worker
+    template <typename T>
+    T &local()
+    {
+        size_t id = slot_id<T>();
+        if (id >= _slots.size()) {
+            _slots.resize(id + 1, Slot{nullptr, nullptr});
+        }
+        Slot &slot = _slots[id];
+        if (slot.ptr == nullptr) {
+            slot.ptr     = new T();
+            slot.deleter = &WorkerContext::destroy<T>;
+        }
+        return *static_cast<T *>(slot.ptr);
+    }
+
+    // Context of the worker running the calling thread, nullptr if the
+    // caller is not a worker
+    static WorkerContext *current();
+    static void set_current(WorkerContext *);
+
+private:
+    struct Slot {
+        void *ptr;
+        void (*deleter)(void *);
+    };
+
+    static size_t next_slot_id();
+
+    template <typename T>
+    static size_t slot_id()
+    {
+        static const size_t id = next_slot_id();
+        return id;
+    }
+
+    template <typename T>
+    static void destroy(void *ptr)
+    {
+        delete static_cast<T *>(ptr);
+    }
+
+    size_t            _index;
+    const void *      _owner;
+    Arena             _arena;
+    std::vector<Slot> _slots;
+};
+
+END_NAMESPACE
+#endif
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,220 @@
+/**
+ * A thread pool framework
+ * Copyright 2017 (c), Oshyn Song (dualyangsong@gmail.com)
+ *
+ * @file    journal.cpp
+ * @author  Oshyn Song
+ * @time    2017.8
+ */
+#include "journal.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <map>
+
+BEGIN_NAMESPACE
+
+namespace {
+
+const uint32_t JOURNAL_MAGIC = 0x314a5054;  // "TPJ1"
+const uint32_t RECORD_MAGIC  = 0x52435054;  // "TPCR"
+
+enum RecordState {
+    WRITING = 0,  // Torn if found at the replay
+    PENDING = 1,
+    DONE    = 2
+};
+
+size_t align8(size_t size)
+{
+    return (size + 7) & ~static_cast<size_t>(7);
+}
+
+std::map<std::string, TaskFactory> &get_factories()
+{
+    static std::map<std::string, TaskFactory> s_factories;
+    return s_factories;
+}
+
+} // namespace
+
+struct TaskJournal::Header {
+    uint32_t              magic;
+    uint32_t              reserved;
+    uint64_t              size;
+    std::atomic<uint64_t> tail;  // End of the records written
+};
+
+struct TaskJournal::Record {
+    uint32_t              magic;
+    std::atomic<uint32_t> state;
+    uint32_t              type_len;
+    uint32_t              data_len;
+};
+
+TaskJournal::TaskJournal(const char *path, size_t segment_size, size_t sync_batch)
+    : _fd(-1), _base(nullptr), _size(segment_size), _sync_batch(sync_batch ? sync_batch : 1),
+      _pending(0), _completed(0), _mutex("TaskJournal")
+{
+    _fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (_fd < 0) {
+        return;
+    }
+
+    struct stat st;
+    if (fstat(_fd, &st) == 0 && static_cast<size_t>(st.st_size) > _size) {
+        _size = static_cast<size_t>(st.st_size);
+    }
+    if (ftruncate(_fd, static_cast<off_t>(_size)) != 0) {
+        close(_fd);
+        _fd = -1;
+        return;
+    }
+
+    void *base = mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (base == MAP_FAILED) {
+        close(_fd);
+        _fd = -1;
+        return;
+    }
+    _base = static_cast<char *>(base);
+
+    // A new or foreign file starts empty
+    Header *header = get_header();
+    if (header->magic != JOURNAL_MAGIC || header->size != _size) {
+        header->magic = JOURNAL_MAGIC;
+        header->size  = _size;
+        header->tail.store(align8(sizeof(Header)));
+    }
+}
+
+TaskJournal::~TaskJournal()
+{
+    if (_base != nullptr) {
+        msync(_base, _size, MS_SYNC);
+        munmap(_base, _size);
+        _base = nullptr;
+    }
+    if (_fd >= 0) {
+        close(_fd);
+        _fd = -1;
+    }
+}
+
+void TaskJournal::register_type(const char *type, TaskFactory factory)
+{
+    get_factories()[type] = factory;
+}
+
+SerializableTask *TaskJournal::create_task(const std::string &type, const std::string &data)
+{
+    auto iter = get_factories().find(type);
+    return (iter != get_factories().end()) ? iter->second(data) : nullptr;
+}
+
+TaskJournal::Header *TaskJournal::get_header() const
+{
+    return reinterpret_cast<Header *>(_base);
+}
+
+std::vector<TaskJournal::Entry> TaskJournal::replay()
+{
+    std::vector<Entry> entries;
+    if (_base == nullptr) {
+        return entries;
+    }
+
+    _mutex.lock();
+    uint64_t tail = get_header()->tail.load();
+    uint64_t offset = align8(sizeof(Header));
+    while (offset + sizeof(Record) <= tail) {
+        Record *record = reinterpret_cast<Record *>(_base + offset);
+        if (record->magic != RECORD_MAGIC) {
+            break;
+        }
+
+        const char *type = _base + offset + sizeof(Record);
+        if (record->state.load() == PENDING) {
+            SerializableTask *task = create_task(std::string(type, record->type_len),
+                                                 std::string(type + record->type_len,
+                                                             record->data_len));
+            if (task != nullptr) {
+                entries.push_back(Entry{offset, task});
+                ++_pending;
+            } else {
+                // Unknown type, not to be replayed forever
+                record->state.store(DONE);
+            }
+        }
+        offset += align8(sizeof(Record) + record->type_len + record->data_len);
+    }
+    _mutex.unlock();
+
+    return entries;
+}
+
+bool TaskJournal::append(const SerializableTask *task, uint64_t *offset)
+{
+    if (_base == nullptr) {
+        return false;
+    }
+
+    const char *type = task->get_type();
+    std::string data = task->serialize();
+    size_t type_len = strlen(type);
+    size_t length = align8(sizeof(Record) + type_len + data.size());
+
+    _mutex.lock();
+    Header *header = get_header();
+    uint64_t tail = header->tail.load();
+    if (tail + length > _size && _pending.load() == 0) {
+        // All done, start over
+        tail = align8(sizeof(Header));
+        header->tail.store(tail);
+    }
+    if (tail + length > _size) {
+        _mutex.unlock();
+        return false;
+    }
+
+    // Written fully before being marked pending and covered by the tail
+    Record *record = reinterpret_cast<Record *>(_base + tail);
+    record->state.store(WRITING);
+    record->magic    = RECORD_MAGIC;
+    record->type_len = static_cast<uint32_t>(type_len);
+    record->data_len = static_cast<uint32_t>(data.size());
+    memcpy(_base + tail + sizeof(Record), type, type_len);
+    memcpy(_base + tail + sizeof(Record) + type_len, data.data(), data.size());
+    record->state.store(PENDING, std::memory_order_release);
+    header->tail.store(tail + length, std::memory_order_release);
+    ++_pending;
+    _mutex.unlock();
+
+    *offset = tail;
+    return true;
+}
+
+// Marked in memory at once, synced to the file every sync_batch tasks
+void TaskJournal::complete(uint64_t offset)
+{
+    Record *record = reinterpret_cast<Record *>(_base + offset);
+    record->state.store(DONE, std::memory_order_release);
+    --_pending;
+    if (++_completed % _sync_batch == 0) {
+        msync(_base, _size, MS_ASYNC);
+    }
+}
+
+void TaskJournal::sync()
+{
+    if (_base != nullptr) {
+        msync(_base, _size, MS_SYNC);
+    }
+}
+
+END_NAMESPACE
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
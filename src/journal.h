@@ -0,0 +1,93 @@
+/**
+ * A thread pool framework
+ * Copyright 2017 (c), Oshyn Song (dualyangsong@gmail.com)
+ *
+ * @file    journal.h
+ * @author  Oshyn Song
+ * @time    2017.8
+ */
+#ifndef THREADPOOL_JOURNAL_H
+#define THREADPOOL_JOURNAL_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "util.h"
+#include "task.h"
+
+BEGIN_NAMESPACE
+
+/**
+ * Task which can be written to a TaskJournal and created again from it
+ */
+class SerializableTask : public Task {
+public:
+    // Same as the type registered by TaskJournal::register_type()
+    virtual const char *get_type() const = 0;
+    virtual std::string serialize() const = 0;
+};
+
+typedef SerializableTask *(*TaskFactory)(const std::string &data);
+
+/**
+ * Write-ahead journal of the queued tasks in a memory-mapped segment file.
+ * The tasks are appended when added and marked done when finished, the
+ * unfinished ones are replayed after a restart. The segment starts over
+ * once full and all of its tasks are done.
+ */
+class TaskJournal {
+public:
+    struct Entry {
+        uint64_t           offset;
+        SerializableTask * task;
+    };
+
+    // Sync the completions to the file every sync_batch tasks
+    TaskJournal(const char *path, size_t segment_size=16 * 1024 * 1024,
+                size_t sync_batch=64);
+    ~TaskJournal();
+
+    // No copying
+    TaskJournal(const TaskJournal &) = delete;
+    TaskJournal &operator=(const TaskJournal &) = delete;
+
+    // Must be called before opening the journals to replay
+    static void register_type(const char *type, TaskFactory factory);
+
+    // Return nullptr if the type is not registered
+    static SerializableTask *create_task(const std::string &type, const std::string &data);
+
+    bool is_open() const { return _base != nullptr; }
+
+    // Create the unfinished tasks of the segment, owned by the caller
+    std::vector<Entry> replay();
+
+    // Return false if the segment is full
+    bool append(const SerializableTask *task, uint64_t *offset);
+    void complete(uint64_t offset);
+    void sync();
+
+    size_t get_pending_num() const { return _pending.load(); }
+
+private:
+    struct Header;
+    struct Record;
+
+    Header *get_header() const;
+
+    int                 _fd;
+    char *              _base;
+    size_t              _size;
+    size_t              _sync_batch;
+    std::atomic<size_t> _pending;
+    std::atomic<size_t> _completed;
+    Mutex               _mutex;
+};
+
+END_NAMESPACE
+#endif
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
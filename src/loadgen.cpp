@@ -0,0 +1,452 @@
+// Open-loop load generator of the threadpool project
+//
+// Tasks are submitted at a fixed arrival rate no matter how fast they
+// complete, and the latency is measured from the intended submit time so
+// that a stalled producer does not hide the queueing (coordinated omission).
+#include <getopt.h>
+#include <sched.h>
+#include <time.h>
+
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "util.h"
+#include "task.h"
+#include "threadpool.h"
+#include "taskstats.h"
+
+namespace {
+
+unsigned long long now_ns()
+{
+    return tp_ns::get_monotonic_ns();
+}
+
+void sleep_until_ns(unsigned long long ns)
+{
+    struct timespec ts;
+    ts.tv_sec  = static_cast<time_t>(ns / 1000000000ULL);
+    ts.tv_nsec = static_cast<long>(ns % 1000000000ULL);
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr);
+}
+
+// Log-linear histogram of nanoseconds, 16 sub-buckets per power of two
+class Histogram {
+public:
+    static const int SUB_BITS    = 4;
+    static const int SUB_BUCKETS = 1 << SUB_BITS;
+    static const int BUCKETS     = (64 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    Histogram() : _max(0)
+    {
+        clear();
+    }
+
+    void record(unsigned long long value)
+    {
+        ++_counts[index_of(value)];
+        unsigned long long cur = _max.load(std::memory_order_relaxed);
+        while (value > cur && !_max.compare_exchange_weak(cur, value)) {
+            // Retry with the updated cur
+        }
+    }
+
+    void clear()
+    {
+        for (auto &c : _counts) {
+            c = 0;
+        }
+        _max = 0;
+    }
+
+    unsigned long long total() const
+    {
+        unsigned long long n = 0;
+        for (auto &c : _counts) {
+            n += c.load();
+        }
+        return n;
+    }
+
+    unsigned long long max() const { return _max.load(); }
+
+    // Upper bound of the bucket holding the quantile
+    unsigned long long quantile(double q) const
+    {
+        unsigned long long n = total();
+        if (n == 0) {
+            return 0;
+        }
+        unsigned long long rank = static_cast<unsigned long long>(std::ceil(q * n));
+        unsigned long long seen = 0;
+        for (int i = 0; i < BUCKETS; ++i) {
+            seen += _counts[i].load();
+            if (seen >= rank && seen > 0) {
+                unsigned long long upper = upper_of(i);
+                return upper < max() ? upper : max();
+            }
+        }
+        return max();
+    }
+
+private:
+    static int index_of(unsigned long long v)
+    {
+        if (v < static_cast<unsigned long long>(SUB_BUCKETS)) {
+            return static_cast<int>(v);
+        }
+        int msb = 63 - __builtin_clzll(v);
+        int shift = msb - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + static_cast<int>((v >> shift) & (SUB_BUCKETS - 1));
+    }
+
+    static unsigned long long upper_of(int index)
+    {
+        if (index < SUB_BUCKETS) {
+            return static_cast<unsigned long long>(index);
+        }
+        int shift = index / SUB_BUCKETS - 1;
+        unsigned long long sub = static_cast<unsigned long long>(index % SUB_BUCKETS);
+        return ((sub | SUB_BUCKETS) << shift) + ((1ULL << shift) - 1);
+    }
+
+    std::atomic<unsigned long long> _counts[BUCKETS];
+    std::atomic<unsigned long long> _max;
+};
+
+// Distribution of the task running time in nanoseconds
+class Duration {
+public:
+    enum Kind {
+        FIXED,
+        EXPONENTIAL,
+        UNIFORM,
+        BIMODAL
+    };
+
+    // fixed:US | exp:MEAN_US | uniform:MIN_US:MAX_US | bimodal:US1:US2:P2
+    bool parse(const char *spec)
+    {
+        double a = 0.0, b = 0.0, p = 0.0;
+        if (sscanf(spec, "fixed:%lf", &a) == 1) {
+            _kind = FIXED;
+        } else if (sscanf(spec, "exp:%lf", &a) == 1) {
+            _kind = EXPONENTIAL;
+        } else if (sscanf(spec, "uniform:%lf:%lf", &a, &b) == 2 && b >= a) {
+            _kind = UNIFORM;
+        } else if (sscanf(spec, "bimodal:%lf:%lf:%lf", &a, &b, &p) == 3 && p >= 0 && p <= 1) {
+            _kind = BIMODAL;
+        } else {
+            return false;
+        }
+        _a = a * 1000.0;
+        _b = b * 1000.0;
+        _p = p;
+        return a >= 0 && b >= 0;
+    }
+
+    unsigned long long sample(std::mt19937_64 &rng) const
+    {
+        std::uniform_real_distribution<double> unit(0.0, 1.0);
+        switch (_kind) {
+            case EXPONENTIAL:
+                return static_cast<unsigned long long>(-std::log(1.0 - unit(rng)) * _a);
+            case UNIFORM:
+                return static_cast<unsigned long long>(_a + unit(rng) * (_b - _a));
+            case BIMODAL:
+                return static_cast<unsigned long long>(unit(rng) < _p ? _b : _a);
+            default:
+                return static_cast<unsigned long long>(_a);
+        }
+    }
+
+private:
+    Kind   _kind = FIXED;
+    double _a    = 10000.0;
+    double _b    = 0.0;
+    double _p    = 0.0;
+};
+
+struct Stats {
+    Histogram                       latency;
+    std::atomic<unsigned long long> submitted;
+    std::atomic<unsigned long long> completed;
+    std::atomic<unsigned long long> rejected;
+};
+
+class LoadTask;
+
+// Tasks are recycled by their producer, the pool keeps no ownership
+class TaskFreeList {
+public:
+    ~TaskFreeList();
+    LoadTask *get();
+    void put(LoadTask *task);
+
+private:
+    std::vector<LoadTask*> _free;
+    std::vector<LoadTask*> _all;
+    tp_ns::Mutex           _mutex;
+};
+
+class LoadTask : public tp_ns::Task {
+public:
+    explicit LoadTask(TaskFreeList *owner)
+        : _stats(nullptr), _owner(owner), _intended_ns(0), _service_ns(0)
+    {
+        set_tname("load");
+    }
+
+    void prepare(Stats *stats, unsigned long long intended_ns, unsigned long long service_ns)
+    {
+        _stats       = stats;
+        _intended_ns = intended_ns;
+        _service_ns  = service_ns;
+    }
+
+    int run(void *) override
+    {
+        // Burn the CPU like a compute task would
+        unsigned long long end = now_ns() + _service_ns;
+        while (now_ns() < end) {
+            // Busy running
+        }
+
+        _stats->latency.record(now_ns() - _intended_ns);
+        ++_stats->completed;
+        _owner->put(this);
+        return 0;
+    }
+
+private:
+    Stats *            _stats;
+    TaskFreeList *     _owner;
+    unsigned long long _intended_ns;
+    unsigned long long _service_ns;
+};
+
+TaskFreeList::~TaskFreeList()
+{
+    for (auto task : _all) {
+        delete task;
+    }
+}
+
+LoadTask *TaskFreeList::get()
+{
+    LoadTask *task = nullptr;
+    _mutex.lock();
+    if (!_free.empty()) {
+        task = _free.back();
+        _free.pop_back();
+    } else {
+        task = new LoadTask(this);
+        _all.push_back(task);
+    }
+    _mutex.unlock();
+    return task;
+}
+
+void TaskFreeList::put(LoadTask *task)
+{
+    _mutex.lock();
+    _free.push_back(task);
+    _mutex.unlock();
+}
+
+struct Options {
+    std::vector<double> rates{1000.0};
+    unsigned            producers = 1;
+    unsigned long long  threads   = 4;
+    double              seconds   = 5.0;
+    bool                poisson   = true;
+    unsigned long long  queue     = 1 << 20;
+    Duration            duration;
+    const char *        trace     = nullptr;
+};
+
+void usage(const char *prog)
+{
+    std::cerr << "Usage: " << prog << " [options]\n"
+              << "  -r RATES     offered loads in tasks/s, comma separated (1000)\n"
+              << "  -p NUM       producer threads (1)\n"
+              << "  -t NUM       worker threads of the pool (4)\n"
+              << "  -d SECONDS   duration of each load step (5)\n"
+              << "  -a KIND      arrival process: poisson | constant (poisson)\n"
+              << "  -s DIST      task duration in us: fixed:US | exp:MEAN | uniform:MIN:MAX |"
+              << " bimodal:US1:US2:P2 (fixed:10)\n"
+              << "  -q NUM       max queued tasks of the pool (1048576)\n"
+              << "  -o PATH      record the arrival trace for threadpoolsim\n";
+}
+
+bool parse_options(int argc, char *argv[], Options &opts)
+{
+    int c = 0;
+    while ((c = getopt(argc, argv, "r:p:t:d:a:s:q:o:h")) != -1) {
+        switch (c) {
+            case 'r': {
+                opts.rates.clear();
+                std::string list(optarg);
+                size_t pos = 0;
+                while (pos <= list.size()) {
+                    size_t comma = list.find(',', pos);
+                    if (comma == std::string::npos) {
+                        comma = list.size();
+                    }
+                    double rate = atof(list.substr(pos, comma - pos).c_str());
+                    if (rate <= 0) {
+                        return false;
+                    }
+                    opts.rates.push_back(rate);
+                    pos = comma + 1;
+                }
+                break;
+            }
+            case 'p':
+                opts.producers = static_cast<unsigned>(atoi(optarg));
+                break;
+            case 't':
+                opts.threads = strtoull(optarg, nullptr, 10);
+                break;
+            case 'd':
+                opts.seconds = atof(optarg);
+                break;
+            case 'a':
+                if (strcmp(optarg, "poisson") == 0) {
+                    opts.poisson = true;
+                } else if (strcmp(optarg, "constant") == 0) {
+                    opts.poisson = false;
+                } else {
+                    return false;
+                }
+                break;
+            case 's':
+                if (!opts.duration.parse(optarg)) {
+                    return false;
+                }
+                break;
+            case 'q':
+                opts.queue = strtoull(optarg, nullptr, 10);
+                break;
+            case 'o':
+                opts.trace = optarg;
+                break;
+            default:
+                return false;
+        }
+    }
+    return opts.producers > 0 && opts.threads > 0 && opts.seconds > 0 && opts.queue > 0;
+}
+
+void produce(tp_ns::ThreadPool *pool, const Options *opts, double rate, unsigned seed,
+        unsigned long long begin_ns, unsigned long long end_ns, Stats *stats,
+        TaskFreeList *free_list)
+{
+    std::mt19937_64 rng(seed);
+    std::exponential_distribution<double> interval(rate / 1e9);
+    double step = 1e9 / rate;
+
+    // The schedule never waits for the pool, only for the clock
+    double intended = static_cast<double>(begin_ns) + (opts->poisson ? interval(rng) : step);
+    while (intended < static_cast<double>(end_ns)) {
+        unsigned long long intended_ns = static_cast<unsigned long long>(intended);
+        if (now_ns() < intended_ns) {
+            sleep_until_ns(intended_ns);
+        }
+
+        LoadTask *task = free_list->get();
+        task->prepare(stats, intended_ns, opts->duration.sample(rng));
+        if (pool->add_task(task)) {
+            ++stats->submitted;
+        } else {
+            ++stats->rejected;
+            free_list->put(task);
+        }
+        intended += opts->poisson ? interval(rng) : step;
+    }
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    Options opts;
+    if (!parse_options(argc, argv, opts)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    tp_ns::ThreadPool pool(opts.threads, opts.threads, opts.queue);
+    if (opts.trace != nullptr) {
+        tp_ns::TaskStats::enable(true);
+        tp_ns::TaskStats::record_arrivals(16 * 1024 * 1024);
+    }
+
+    // The pool dispatches the queued tasks only inside run()
+    std::atomic<bool> stop(false);
+    std::thread dispatcher([&pool, &stop]() {
+        while (!stop.load()) {
+            pool.run();
+            sched_yield();
+        }
+    });
+
+    printf("%12s %12s %10s %10s %10s %10s %10s %10s\n", "offered/s", "achieved/s",
+            "rejected", "p50_us", "p99_us", "p99.9_us", "max_us", "backlog");
+
+    std::vector<TaskFreeList> free_lists(opts.producers);
+    for (double rate : opts.rates) {
+        Stats stats;
+        stats.submitted = 0;
+        stats.completed = 0;
+        stats.rejected  = 0;
+
+        unsigned long long begin_ns = now_ns();
+        unsigned long long end_ns = begin_ns + static_cast<unsigned long long>(opts.seconds * 1e9);
+        std::vector<std::thread> producers;
+        for (unsigned i = 0; i < opts.producers; ++i) {
+            producers.emplace_back(produce, &pool, &opts, rate / opts.producers, 7919 * (i + 1),
+                    begin_ns, end_ns, &stats, &free_lists[i]);
+        }
+        for (auto &producer : producers) {
+            producer.join();
+        }
+
+        // The backlog at the end of the step tells whether the pool kept up
+        unsigned long long backlog = stats.submitted.load() - stats.completed.load();
+        while (stats.completed.load() < stats.submitted.load()) {
+            sleep_until_ns(now_ns() + 1000000ULL);
+        }
+        double elapsed = (now_ns() - begin_ns) / 1e9;
+
+        printf("%12.0f %12.0f %10llu %10.1f %10.1f %10.1f %10.1f %10llu\n", rate,
+                stats.completed.load() / elapsed, stats.rejected.load(),
+                stats.latency.quantile(0.5) / 1e3, stats.latency.quantile(0.99) / 1e3,
+                stats.latency.quantile(0.999) / 1e3, stats.latency.max() / 1e3, backlog);
+        fflush(stdout);
+    }
+
+    stop = true;
+    dispatcher.join();
+    pool.shutdown();
+
+    if (opts.trace != nullptr && !tp_ns::TaskStats::dump_arrivals(opts.trace)) {
+        std::cerr << "Failed to write the trace " << opts.trace << std::endl;
+        return 1;
+    }
+    if (opts.trace != nullptr && tp_ns::TaskStats::get_dropped_arrivals() > 0) {
+        std::cerr << "Warning: the trace is truncated, "
+                  << tp_ns::TaskStats::get_dropped_arrivals()
+                  << " arrivals beyond its capacity were dropped" << std::endl;
+    }
+    return 0;
+}
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,242 @@
+/**
+ * A thread pool framework
+ * Copyright 2017 (c), Oshyn Song (dualyangsong@gmail.com)
+ *
+ * @file    pipeline.cpp
+ * @author  Oshyn Song
+ * @time    2017.8
+ */
+#include "pipeline.h"
+#include "taskstats.h"
+#include "threadpool.h"
+
+BEGIN_NAMESPACE
+
+namespace {
+
+// Counted under the name of the filter, not of the token running it
+void *run_filter(PipelineFilter *filter, void *item)
+{
+    TaskStats::Sample sample;
+    bool measured = stats_begin(filter->get_name(), &sample);
+    item = filter->process(item);
+    if (measured) {
+        TaskStats::end(sample);
+    }
+    return item;
+}
+
+} // namespace
+
+// An item in flight, owned by the pipeline and requeued to the pool after
+// waiting at a serial filter
+class Pipeline::Token : public Task {
+public:
+    explicit Token(Pipeline *pipeline)
+        : stage(0), seq(0), item(nullptr), _pipeline(pipeline)
+    {
+        set_tname("Pipeline");
+    }
+
+    int run(void *) override
+    {
+        _pipeline->process(this);
+        return 0;
+    }
+
+    size_t   stage;  // Next filter to run
+    uint64_t seq;    // Input order of the item
+    void *   item;
+
+private:
+    Pipeline *_pipeline;
+};
+
+Pipeline::Pipeline(ThreadPool *pool)
+    : _pool(pool), _stages(), _input_done(false), _next_seq(0), _active(0), _queued(false),
+      _stalled(), _mutex("Pipeline"), _cond(&_mutex)
+{
+    // Nothing to do
+}
+
+Pipeline::~Pipeline()
+{
+    for (auto stage : _stages) {
+        if (stage->need_clear) {
+            delete stage->filter;
+        }
+        delete stage;
+    }
+    _stages.clear();
+    _pool = nullptr;
+}
+
+void Pipeline::add_filter(PipelineFilter *filter, bool need_clear)
+{
+    _stages.push_back(new Stage(filter, need_clear));
+}
+
+bool Pipeline::run(size_t max_tokens)
+{
+    if (_stages.empty() || max_tokens == 0) {
+        return false;
+    }
+
+    _input_done = false;
+    _next_seq = 0;
+    for (auto stage : _stages) {
+        stage->next_seq = 0;
+    }
+
+    std::vector<Token*> tokens;
+    for (size_t i = 0; i < max_tokens; ++i) {
+        tokens.push_back(new Token(this));
+    }
+    _mutex.lock();
+    _active = max_tokens;
+    _mutex.unlock();
+    for (auto token : tokens) {
+        schedule(token);
+    }
+
+    // The caller dispatches the requeued tokens like ThreadPool::run(), or
+    // runs the other queued tasks if it is a worker of the pool, as the
+    // tokens may be queued behind them
+    bool helping = _pool->is_own_worker();
+    _mutex.lock();
+    while (_active > 0) {
+        if (!_stalled.empty()) {
+            Token *token = _stalled.front();
+            _stalled.pop_front();
+            _mutex.unlock();
+            process(token);
+            _mutex.lock();
+            continue;
+        }
+
+        _queued = false;
+        _mutex.unlock();
+        if (helping) {
+            _pool->run_queued_task();
+        } else {
+            _pool->run();
+        }
+        _mutex.lock();
+        if (_active > 0 && _stalled.empty() && !_queued) {
+            if (helping) {
+                _cond.wait(make_deadline(1));
+            } else {
+                _cond.wait();
+            }
+        }
+    }
+    _mutex.unlock();
+
+    for (auto token : tokens) {
+        delete token;
+    }
+    return true;
+}
+
+void Pipeline::process(Token *token)
+{
+    for (;;) {
+        if (token->stage == 0 && !read_input(token)) {
+            finish(token);
+            return;
+        }
+        if (token->stage == _stages.size()) {
+            token->stage = 0;
+            continue;
+        }
+
+        // The dropped items still pass the serial filters to keep the order
+        Stage *stage = _stages[token->stage];
+        if (stage->filter->get_mode() == PipelineFilter::PARALLEL) {
+            if (token->item != nullptr) {
+                token->item = run_filter(stage->filter, token->item);
+            }
+        } else {
+            if (!enter_serial(stage, token)) {
+                return;  // Parked, requeued once its turn comes
+            }
+            if (token->item != nullptr) {
+                token->item = run_filter(stage->filter, token->item);
+            }
+            leave_serial(stage);
+        }
+        ++token->stage;
+    }
+}
+
+bool Pipeline::read_input(Token *token)
+{
+    Stage *input = _stages[0];
+    input->mutex.lock();
+    void *item = _input_done ? nullptr : run_filter(input->filter, nullptr);
+    if (item == nullptr) {
+        _input_done = true;
+        input->mutex.unlock();
+        return false;
+    }
+    token->seq = _next_seq++;
+    input->mutex.unlock();
+
+    token->item = item;
+    token->stage = 1;
+    return true;
+}
+
+bool Pipeline::enter_serial(Stage *stage, Token *token)
+{
+    stage->mutex.lock();
+    if (token->seq != stage->next_seq) {
+        stage->parked[token->seq] = token;
+        stage->mutex.unlock();
+        return false;
+    }
+    stage->mutex.unlock();
+    return true;
+}
+
+void Pipeline::leave_serial(Stage *stage)
+{
+    Token *next = nullptr;
+    stage->mutex.lock();
+    auto iter = stage->parked.find(++stage->next_seq);
+    if (iter != stage->parked.end()) {
+        next = iter->second;
+        stage->parked.erase(iter);
+    }
+    stage->mutex.unlock();
+
+    if (next != nullptr) {
+        schedule(next);
+    }
+}
+
+void Pipeline::schedule(Token *token)
+{
+    bool queued = _pool->add_task(token);
+
+    _mutex.lock();
+    if (queued) {
+        _queued = true;
+    } else {
+        _stalled.push_back(token);
+    }
+    _cond.signal();
+    _mutex.unlock();
+}
+
+void Pipeline::finish(Token *)
+{
+    _mutex.lock();
+    if (--_active == 0) {
+        _cond.broadcast();
+    }
+    _mutex.unlock();
+}
+
+END_NAMESPACE
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,119 @@
+/**
+ * A thread pool framework
+ * Copyright 2017 (c), Oshyn Song (dualyangsong@gmail.com)
+ *
+ * @file    pipeline.h
+ * @author  Oshyn Song
+ * @time    2017.8
+ */
+#ifndef THREADPOOL_PIPELINE_H
+#define THREADPOOL_PIPELINE_H
+
+#include <stdint.h>
+
+#include <deque>
+#include <map>
+#include <vector>
+
+#include "common.h"
+#include "util.h"
+#include "task.h"
+
+BEGIN_NAMESPACE
+
+class ThreadPool;
+
+/**
+ * A stage of a Pipeline. The first filter reads the input: it is given
+ * nullptr and returns nullptr at the end. The others return the item for
+ * the next filter, or nullptr to drop it. The time of process() is counted
+ * by TaskStats under the name, which must outlive the stats as the task
+ * names do.
+ */
+class PipelineFilter {
+public:
+    enum Mode {
+        SERIAL,   // One item at a time, in the order of the input
+        PARALLEL  // Any number of items at the same time
+    };
+
+    explicit PipelineFilter(Mode mode, const char *name="PipelineFilter")
+        : _mode(mode), _name(name) {}
+    virtual ~PipelineFilter() {}
+
+    virtual void *process(void *item) = 0;
+
+    Mode get_mode() const { return _mode; }
+    const char *get_name() const { return _name; }
+
+private:
+    Mode         _mode;
+    const char * _name;
+};
+
+/**
+ * Items flowing through a sequence of filters on the workers of a pool.
+ * At most max_tokens items are in flight, each one carried by a token
+ * which runs it through the filters and then reads the next input. A token
+ * reaching a serial filter out of turn is parked there and requeued by the
+ * token before it, so no worker waits for the order.
+ */
+class Pipeline {
+public:
+    explicit Pipeline(ThreadPool *pool);
+    ~Pipeline();
+
+    // No copying
+    Pipeline(const Pipeline &) = delete;
+    Pipeline &operator=(const Pipeline &) = delete;
+
+    // Must not be called while running
+    void add_filter(PipelineFilter *filter, bool need_clear=false);
+
+    // Block until the input ended and all items finished. The caller
+    // dispatches the tokens to the workers as ThreadPool::run() does, and
+    // runs the ones the pool has no room for. Return false if there is no
+    // filter or max_tokens is 0.
+    bool run(size_t max_tokens);
+
+    // Items read from the input by the last run
+    uint64_t get_item_num() const { return _next_seq; }
+
+private:
+    class Token;
+
+    struct Stage {
+        Stage(PipelineFilter *f, bool clear)
+            : filter(f), need_clear(clear), next_seq(0), parked(), mutex("Pipeline::stage") {}
+
+        PipelineFilter *           filter;
+        bool                       need_clear;
+        uint64_t                   next_seq;  // Of the SERIAL filter
+        std::map<uint64_t, Token*> parked;    // Out of turn, by the input order
+        Mutex                      mutex;
+    };
+
+    void process(Token *token);
+    bool read_input(Token *token);
+    bool enter_serial(Stage *stage, Token *token);
+    void leave_serial(Stage *stage);
+    void schedule(Token *token);
+    void finish(Token *token);
+
+    ThreadPool *        _pool;
+    std::vector<Stage*> _stages;
+
+    // Guarded by the mutex of the first stage
+    bool                _input_done;
+    uint64_t            _next_seq;
+
+    size_t              _active;
+    bool                _queued;   // To be dispatched by the caller of run()
+    std::deque<Token*>  _stalled;  // Not accepted by the pool
+    Mutex               _mutex;
+    Condition           _cond;
+};
+
+END_NAMESPACE
+#endif
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,240 @@
+/**
+ * A thread pool framework
+ * Copyright 2017 (c), Oshyn Song (dualyangsong@gmail.com)
+ *
+ * @file    policy.h
+ * @author  Oshyn Song
+ * @time    2017.8
+ */
+#ifndef THREADPOOL_POLICY_H
+#define THREADPOOL_POLICY_H
+
+#include <sched.h>
+
+#include <atomic>
+#include <vector>
+
+#include "common.h"
+#include "util.h"
+#include "task.h"
+
+BEGIN_NAMESPACE
+
+// Task queued by BasicThreadPool
+struct TaskEntry {
+    Task * task;
+    void * arg;
+    bool   need_clear;
+};
+
+/**
+ * Capacities of BasicThreadPool fixed at compile time
+ */
+template <size_t Threads, size_t MaxTasks>
+struct FixedCapacity {
+    static_assert(Threads > 0, "A pool needs one thread at least");
+    static_assert(MaxTasks > 0, "A pool needs to queue one task at least");
+
+    static const size_t threads   = Threads;
+    static const size_t max_tasks = MaxTasks;
+};
+
+/**
+ * Bounded FIFO ring of N tasks
+ */
+template <size_t N>
+class FifoQueue {
+public:
+    FifoQueue() : _items(N), _head(0), _size(0), _mutex("FifoQueue") {}
+
+    bool push(const TaskEntry &entry)
+    {
+        _mutex.lock();
+        bool ok = (_size < N);
+        if (ok) {
+            _items[(_head + _size) % N] = entry;
+            ++_size;
+        }
+        _mutex.unlock();
+        return ok;
+    }
+
+    bool pop(TaskEntry &entry)
+    {
+        _mutex.lock();
+        bool ok = (_size > 0);
+        if (ok) {
+            entry = _items[_head];
+            _head = (_head + 1) % N;
+            --_size;
+        }
+        _mutex.unlock();
+        return ok;
+    }
+
+    size_t size()
+    {
+        _mutex.lock();
+        size_t size = _size;
+        _mutex.unlock();
+        return size;
+    }
+
+private:
+    std::vector<TaskEntry> _items;
+    size_t                 _head;
+    size_t                 _size;
+    Mutex                  _mutex;
+};
+
+/**
+ * Bounded queue of N tasks in total, the higher priority goes first and
+ * the same priority in FIFO order
+ */
+template <size_t N>
+class PriorityQueue {
+public:
+    static const int LEVELS = Task::HIGH + 1;
+
+    PriorityQueue() : _size(0), _mutex("PriorityQueue")
+    {
+        for (int i = 0; i < LEVELS; ++i) {
+            _items[i].resize(N);
+            _heads[i] = 0;
+            _sizes[i] = 0;
+        }
+    }
+
+    bool push(const TaskEntry &entry)
+    {
+        int level = static_cast<int>(entry.task->get_priority());
+        _mutex.lock();
+        bool ok = (_size < N);
+        if (ok) {
+            _items[level][(_heads[level] + _sizes[level]) % N] = entry;
+            ++_sizes[level];
+            ++_size;
+        }
+        _mutex.unlock();
+        return ok;
+    }
+
+    bool pop(TaskEntry &entry)
+    {
+        bool ok = false;
+        _mutex.lock();
+        for (int level = LEVELS - 1; level >= 0 && !ok; --level) {
+            if (_sizes[level] > 0) {
+                entry = _items[level][_heads[level]];
+                _heads[level] = (_heads[level] + 1) % N;
+                --_sizes[level];
+                --_size;
+                ok = true;
+            }
+        }
+        _mutex.unlock();
+        return ok;
+    }
+
+    size_t size()
+    {
+        _mutex.lock();
+        size_t size = _size;
+        _mutex.unlock();
+        return size;
+    }
+
+private:
+    std::vector<TaskEntry> _items[LEVELS];
+    size_t                 _heads[LEVELS];
+    size_t                 _sizes[LEVELS];
+    size_t                 _size;
+    Mutex                  _mutex;
+};
+
+// Queue policies of BasicThreadPool
+struct FifoPolicy {
+    template <size_t N>
+    using queue_type = FifoQueue<N>;
+};
+
+struct PriorityPolicy {
+    template <size_t N>
+    using queue_type = PriorityQueue<N>;
+};
+
+/**
+ * Idle workers sleep on a condition, notifying is lock free if nobody waits
+ */
+class BlockingWait {
+public:
+    BlockingWait() : _waiters(0), _mutex("BlockingWait"), _cond(&_mutex) {}
+
+    // Block until ready() returns true, which may be called with the lock held
+    template <typename Ready>
+    void wait(Ready ready)
+    {
+        if (ready()) {
+            return;
+        }
+        _mutex.lock();
+        ++_waiters;
+        while (!ready()) {
+            _cond.wait();
+        }
+        --_waiters;
+        _mutex.unlock();
+    }
+
+    void notify_one()
+    {
+        // Pairs with the increase of _waiters before checking ready()
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_waiters.load(std::memory_order_relaxed) > 0) {
+            _mutex.lock();
+            _cond.signal();
+            _mutex.unlock();
+        }
+    }
+
+    void notify_all()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_waiters.load(std::memory_order_relaxed) > 0) {
+            _mutex.lock();
+            _cond.broadcast();
+            _mutex.unlock();
+        }
+    }
+
+private:
+    std::atomic<int> _waiters;
+    Mutex            _mutex;
+    Condition        _cond;
+};
+
+/**
+ * Idle workers keep polling, yielding the CPU after a short spinning.
+ * Lowest latency for dedicated cores, burns them while idle.
+ */
+class SpinWait {
+public:
+    template <typename Ready>
+    void wait(Ready ready)
+    {
+        for (unsigned spins = 0; !ready(); ++spins) {
+            if (spins < 1024) {
+                cpu_relax();
+            } else {
+                sched_yield();
+            }
+        }
+    }
+
+    void notify_one() {}
+    void notify_all() {}
+};
+
+END_NAMESPACE
+#endif
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
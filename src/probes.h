@@ -0,0 +1,70 @@
+/**
+ * A thread pool framework
+ * Copyright 2017 (c), Oshyn Song (dualyangsong@gmail.com)
+ *
+ * @file    probes.h
+ * @author  Oshyn Song
+ * @time    2017.8
+ */
+#ifndef THREADPOOL_PROBES_H
+#define THREADPOOL_PROBES_H
+
+/**
+ * Static tracepoints in the SystemTap SDT format (USDT) of the provider
+ * "tp4cpp", listed by `readelf -n` and attached by perf, bpftrace or
+ * stap without rebuilding. Each probe is a nop plus an ELF note telling
+ * where its arguments are, all 64-bit signed. Build with -DTP_NO_PROBES
+ * to leave them out.
+ */
+#if defined(TP_NO_PROBES) || !defined(__GNUC__) || \
+        !(defined(__x86_64__) || defined(__aarch64__))
+
+#define TP_PROBE0(name)                 do {} while (0)
+#define TP_PROBE1(name, a1)             do {} while (0)
+#define TP_PROBE2(name, a1, a2)         do {} while (0)
+#define TP_PROBE3(name, a1, a2, a3)     do {} while (0)
+
+#else
+
+// Same layout as the STAP_PROBE macros of <sys/sdt.h>
+#define TP_PROBE_NOTE(name, args)                                               \
+    "990: nop\n"                                                                \
+    ".pushsection .note.stapsdt,\"\",\"note\"\n"                                \
+    ".balign 4\n"                                                               \
+    ".4byte 992f-991f, 994f-993f, 3\n"                                          \
+    "991: .asciz \"stapsdt\"\n"                                                 \
+    "992: .balign 4\n"                                                          \
+    "993: .8byte 990b\n"                                                        \
+    ".8byte _.stapsdt.base\n"                                                   \
+    ".8byte 0\n"                                                                \
+    ".asciz \"tp4cpp\"\n"                                                       \
+    ".asciz \"" name "\"\n"                                                     \
+    ".asciz \"" args "\"\n"                                                     \
+    "994: .balign 4\n"                                                          \
+    ".popsection\n"                                                             \
+    ".ifndef _.stapsdt.base\n"                                                  \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n"     \
+    ".weak _.stapsdt.base\n"                                                    \
+    ".hidden _.stapsdt.base\n"                                                  \
+    "_.stapsdt.base: .space 1\n"                                                \
+    ".size _.stapsdt.base, 1\n"                                                 \
+    ".popsection\n"                                                             \
+    ".endif\n"
+
+#define TP_PROBE_ARG(a) "r"((long long)(a))
+
+#define TP_PROBE0(name)                                                         \
+    __asm__ __volatile__(TP_PROBE_NOTE(#name, ""))
+#define TP_PROBE1(name, a1)                                                     \
+    __asm__ __volatile__(TP_PROBE_NOTE(#name, "-8@%0") :: TP_PROBE_ARG(a1))
+#define TP_PROBE2(name, a1, a2)                                                 \
+    __asm__ __volatile__(TP_PROBE_NOTE(#name, "-8@%0 -8@%1")                    \
+                         :: TP_PROBE_ARG(a1), TP_PROBE_ARG(a2))
+#define TP_PROBE3(name, a1, a2, a3)                                             \
+    __asm__ __volatile__(TP_PROBE_NOTE(#name, "-8@%0 -8@%1 -8@%2")              \
+                         :: TP_PROBE_ARG(a1), TP_PROBE_ARG(a2), TP_PROBE_ARG(a3))
+
+#endif
+
+#endif
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,324 @@
+/**
+ * A thread pool framework
+ * Copyright 2017 (c), Oshyn Song (dualyangsong@gmail.com)
+ *
+ * @file    sharedqueue.cpp
+ * @author  Oshyn Song
+ * @time    2017.8
+ */
+#include "sharedqueue.h"
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+#include "util.h"
+
+BEGIN_NAMESPACE
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "the atomics shared by processes must be lock free");
+
+namespace {
+
+const uint32_t QUEUE_MAGIC = 0x31515054;  // "TPQ1"
+
+// Waiting for the creator to finish the header
+const int OPEN_RETRY_NUM = 1000;
+const unsigned int OPEN_RETRY_US = 1000;
+
+size_t align64(size_t size)
+{
+    return (size + 63) & ~static_cast<size_t>(63);
+}
+
+bool is_pow2(size_t num)
+{
+    return num != 0 && (num & (num - 1)) == 0;
+}
+
+size_t round_pow2(size_t num)
+{
+    size_t pow2 = 1;
+    while (pow2 < num) {
+        pow2 <<= 1;
+    }
+    return pow2;
+}
+
+int futex(std::atomic<uint32_t> *word, int op, uint32_t val, const struct timespec *ts)
+{
+    // Not FUTEX_PRIVATE_FLAG, the word is shared by the processes
+    return static_cast<int>(syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), op, val, ts,
+                                    nullptr, FUTEX_BITSET_MATCH_ANY));
+}
+
+} // namespace
+
+struct SharedTaskQueue::Header {
+    std::atomic<uint32_t> magic;  // Set once the rest is initialized
+    uint32_t              slot_num;
+    uint32_t              slot_size;
+
+    alignas(64) std::atomic<uint64_t> enqueue_pos;
+    alignas(64) std::atomic<uint64_t> dequeue_pos;
+
+    // Bumped by every push, the consumers sleep on it
+    alignas(64) std::atomic<uint32_t> futex_word;
+    std::atomic<uint32_t>             waiters;
+};
+
+struct SharedTaskQueue::Slot {
+    std::atomic<uint64_t> seq;
+    uint32_t              type_len;
+    uint32_t              data_len;
+    // Followed by the type and the data
+};
+
+SharedTaskQueue::SharedTaskQueue(const char *name, size_t slot_num, size_t slot_size)
+    : _base(nullptr), _length(0), _slot_num(round_pow2(slot_num ? slot_num : 1)),
+      _slot_size(align64(slot_size > sizeof(Slot) ? slot_size : sizeof(Slot) + 1)), _dropped(0)
+{
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd >= 0) {
+        size_t length = align64(sizeof(Header)) + _slot_num * _slot_size;
+        if (ftruncate(fd, static_cast<off_t>(length)) != 0 || !map(fd, length)) {
+            close(fd);
+            shm_unlink(name);
+            return;
+        }
+        close(fd);
+
+        Header *header = get_header();
+        header->slot_num  = static_cast<uint32_t>(_slot_num);
+        header->slot_size = static_cast<uint32_t>(_slot_size);
+        header->enqueue_pos.store(0);
+        header->dequeue_pos.store(0);
+        header->futex_word.store(0);
+        header->waiters.store(0);
+        for (size_t i = 0; i < _slot_num; ++i) {
+            get_slot(i)->seq.store(i);
+        }
+        header->magic.store(QUEUE_MAGIC, std::memory_order_release);
+        return;
+    }
+    if (errno != EEXIST || (fd = shm_open(name, O_RDWR, 0600)) < 0) {
+        return;
+    }
+
+    // Created by another process, which may not have sized it yet
+    struct stat st;
+    for (int i = 0; i < OPEN_RETRY_NUM; ++i) {
+        if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(Header)) {
+            break;
+        }
+        usleep(OPEN_RETRY_US);
+    }
+    if (static_cast<size_t>(st.st_size) < sizeof(Header) ||
+            !map(fd, static_cast<size_t>(st.st_size))) {
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    Header *header = get_header();
+    for (int i = 0; i < OPEN_RETRY_NUM && header->magic.load() != QUEUE_MAGIC; ++i) {
+        usleep(OPEN_RETRY_US);
+    }
+    // Written by another process, the slot indexing masks by slot_num - 1
+    // and the slots are addressed as aligned Slot records
+    if (header->magic.load(std::memory_order_acquire) != QUEUE_MAGIC ||
+            !is_pow2(header->slot_num) || header->slot_size <= sizeof(Slot) ||
+            header->slot_size % alignof(Slot) != 0 ||
+            align64(sizeof(Header)) + static_cast<size_t>(header->slot_num) * header->slot_size >
+            _length) {
+        munmap(_base, _length);
+        _base = nullptr;
+        return;
+    }
+    _slot_num  = header->slot_num;
+    _slot_size = header->slot_size;
+}
+
+SharedTaskQueue::~SharedTaskQueue()
+{
+    if (_base != nullptr) {
+        munmap(_base, _length);
+        _base = nullptr;
+    }
+}
+
+bool SharedTaskQueue::unlink(const char *name)
+{
+    return shm_unlink(name) == 0;
+}
+
+bool SharedTaskQueue::map(int fd, size_t length)
+{
+    void *base = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        return false;
+    }
+    _base = static_cast<char *>(base);
+    _length = length;
+    return true;
+}
+
+SharedTaskQueue::Header *SharedTaskQueue::get_header() const
+{
+    return reinterpret_cast<Header *>(_base);
+}
+
+SharedTaskQueue::Slot *SharedTaskQueue::get_slot(uint64_t pos) const
+{
+    size_t index = static_cast<size_t>(pos & (_slot_num - 1));
+    return reinterpret_cast<Slot *>(_base + align64(sizeof(Header)) + index * _slot_size);
+}
+
+bool SharedTaskQueue::push(const SerializableTask *task)
+{
+    return push(task->get_type(), task->serialize());
+}
+
+bool SharedTaskQueue::push(const char *type, const std::string &data)
+{
+    size_t type_len = strlen(type);
+    if (_base == nullptr || sizeof(Slot) + type_len + data.size() > _slot_size) {
+        return false;
+    }
+
+    Header *header = get_header();
+    Slot *slot = nullptr;
+    uint64_t pos = header->enqueue_pos.load(std::memory_order_relaxed);
+    for (;;) {
+        slot = get_slot(pos);
+        uint64_t seq = slot->seq.load(std::memory_order_acquire);
+        if (seq == pos) {
+            if (header->enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                                          std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (seq < pos) {
+            return false;  // Full
+        } else {
+            pos = header->enqueue_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    // Written in place, published by the sequence
+    char *bytes = reinterpret_cast<char *>(slot) + sizeof(Slot);
+    slot->type_len = static_cast<uint32_t>(type_len);
+    slot->data_len = static_cast<uint32_t>(data.size());
+    memcpy(bytes, type, type_len);
+    memcpy(bytes + type_len, data.data(), data.size());
+    slot->seq.store(pos + 1, std::memory_order_release);
+
+    wake();
+    return true;
+}
+
+void SharedTaskQueue::wake()
+{
+    Header *header = get_header();
+    header->futex_word.fetch_add(1);
+    if (header->waiters.load() > 0) {
+        futex(&header->futex_word, FUTEX_WAKE, 1, nullptr);
+    }
+}
+
+bool SharedTaskQueue::try_pop(std::string *type, std::string *data)
+{
+    if (_base == nullptr) {
+        return false;
+    }
+
+    Header *header = get_header();
+    for (;;) {
+        Slot *slot = nullptr;
+        uint64_t pos = header->dequeue_pos.load(std::memory_order_relaxed);
+        for (;;) {
+            slot = get_slot(pos);
+            uint64_t seq = slot->seq.load(std::memory_order_acquire);
+            if (seq == pos + 1) {
+                if (header->dequeue_pos.compare_exchange_weak(pos, pos + 1,
+                                                              std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (seq < pos + 1) {
+                return false;  // Empty
+            } else {
+                pos = header->dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        // Written by another process, the lengths are not trusted
+        const char *bytes = reinterpret_cast<const char *>(slot) + sizeof(Slot);
+        size_t type_len = slot->type_len;
+        size_t data_len = slot->data_len;
+        bool valid = (sizeof(Slot) + type_len + data_len <= _slot_size);
+        if (valid) {
+            type->assign(bytes, type_len);
+            data->assign(bytes + type_len, data_len);
+        }
+        slot->seq.store(pos + _slot_num, std::memory_order_release);
+        if (valid) {
+            return true;
+        }
+        ++_dropped;
+    }
+}
+
+SerializableTask *SharedTaskQueue::pop(unsigned long long timeout_ms)
+{
+    if (_base == nullptr) {
+        return nullptr;
+    }
+
+    Header *header = get_header();
+    struct timespec deadline = make_deadline(timeout_ms);
+    std::string type;
+    std::string data;
+    for (;;) {
+        while (try_pop(&type, &data)) {
+            SerializableTask *task = TaskJournal::create_task(type, data);
+            if (task != nullptr) {
+                return task;
+            }
+            ++_dropped;
+        }
+        if (is_expired(deadline)) {
+            return nullptr;
+        }
+
+        // Sleep only if nothing was pushed since the word was read. A slot
+        // claimed but not published yet is slept on as well.
+        uint32_t word = header->futex_word.load();
+        header->waiters.fetch_add(1);
+        uint64_t pos = header->dequeue_pos.load();
+        if (get_slot(pos)->seq.load() != pos + 1) {
+            futex(&header->futex_word, FUTEX_WAIT_BITSET | FUTEX_CLOCK_REALTIME, word, &deadline);
+        }
+        header->waiters.fetch_sub(1);
+    }
+}
+
+size_t SharedTaskQueue::size() const
+{
+    if (_base == nullptr) {
+        return 0;
+    }
+    Header *header = get_header();
+    uint64_t dequeue_pos = header->dequeue_pos.load();
+    uint64_t enqueue_pos = header->enqueue_pos.load();
+    return enqueue_pos > dequeue_pos ? static_cast<size_t>(enqueue_pos - dequeue_pos) : 0;
+}
+
+END_NAMESPACE
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
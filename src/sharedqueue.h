@@ -0,0 +1,88 @@
+/**
+ * A thread pool framework
+ * Copyright 2017 (c), Oshyn Song (dualyangsong@gmail.com)
+ *
+ * @file    sharedqueue.h
+ * @author  Oshyn Song
+ * @time    2017.8
+ */
+#ifndef THREADPOOL_SHAREDQUEUE_H
+#define THREADPOOL_SHAREDQUEUE_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+#include "common.h"
+#include "journal.h"
+
+BEGIN_NAMESPACE
+
+/**
+ * Bounded task queue in POSIX shared memory for the tasks produced by one
+ * process and run by the pools of other processes. The slots are claimed
+ * by atomic sequence numbers (Vyukov's bounded MPMC queue) and the waiting
+ * consumers sleep on a shared futex. The tasks are copied into the slots by
+ * serialize() and created again by the types registered by
+ * TaskJournal::register_type().
+ *
+ * There is no lock, but a process dying between claiming a slot and
+ * storing its sequence, a few instructions in push() or try_pop(), wedges
+ * that slot: the queue looks empty or full at it to every process from
+ * then on. The queue must then be unlinked and created again.
+ */
+class SharedTaskQueue {
+public:
+    // Open the queue of the name, e.g. "/tp4cpp-tasks", or create it with
+    // slot_num (rounded up to a power of 2) slots of slot_size bytes. An
+    // existing queue of a corrupt header is not opened.
+    explicit SharedTaskQueue(const char *name, size_t slot_num=1024, size_t slot_size=256);
+    ~SharedTaskQueue();
+
+    // No copying
+    SharedTaskQueue(const SharedTaskQueue &) = delete;
+    SharedTaskQueue &operator=(const SharedTaskQueue &) = delete;
+
+    // Remove the name, the mapped queues are kept until closed
+    static bool unlink(const char *name);
+
+    bool is_open() const { return _base != nullptr; }
+
+    // Return false if full or the task does not fit in a slot
+    bool push(const SerializableTask *task);
+    bool push(const char *type, const std::string &data);
+
+    // Wait up to timeout_ms for a task, owned by the caller. nullptr on
+    // timeout, tasks of unknown types are dropped.
+    SerializableTask *pop(unsigned long long timeout_ms);
+
+    // Slots of lengths beyond the slot size are dropped
+    bool try_pop(std::string *type, std::string *data);
+
+    // Dropped by this process as corrupt or of unknown types
+    size_t get_dropped_num() const { return _dropped.load(); }
+
+    size_t size() const;
+    size_t get_slot_num() const { return _slot_num; }
+    size_t get_slot_size() const { return _slot_size; }
+
+private:
+    struct Header;
+    struct Slot;
+
+    Header *get_header() const;
+    Slot *get_slot(uint64_t pos) const;
+    bool map(int fd, size_t length);
+    void wake();
+
+    char *              _base;
+    size_t              _length;
+    size_t              _slot_num;
+    size_t              _slot_size;
+    std::atomic<size_t> _dropped;
+};
+
+END_NAMESPACE
+#endif
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
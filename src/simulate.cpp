@@ -0,0 +1,153 @@
+// Offline scheduling simulator of the threadpool project
+//
+// Replays an arrival trace recorded by TaskStats::dump_arrivals() (or
+// threadpoolloadgen -o) against each combination of the thread counts,
+// queue limits and policies given, and prints the predicted waits.
+#include <getopt.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "simulator.h"
+
+namespace {
+
+struct Options {
+    const char *                               path = nullptr;
+    std::vector<size_t>                        threads{4};
+    std::vector<size_t>                        queues{0};
+    std::vector<tp_ns::SimConfig::QueuePolicy> policies{tp_ns::SimConfig::PRIORITY};
+    std::vector<double>                        scales{1.0};
+};
+
+void usage(const char *prog)
+{
+    std::cerr << "Usage: " << prog << " -f TRACE [options]\n"
+              << "  -f PATH      arrival trace written by TaskStats::dump_arrivals()\n"
+              << "  -t NUMS      worker threads, comma separated (4)\n"
+              << "  -q NUMS      max queued tasks, 0 for no limit (0)\n"
+              << "  -p POLICIES  fifo | priority, comma separated (priority)\n"
+              << "  -l SCALES    arrival rate multipliers (1)\n";
+}
+
+std::vector<std::string> split(const char *arg)
+{
+    std::vector<std::string> items;
+    std::string list(arg);
+    size_t pos = 0;
+    while (pos <= list.size()) {
+        size_t comma = list.find(',', pos);
+        if (comma == std::string::npos) {
+            comma = list.size();
+        }
+        items.push_back(list.substr(pos, comma - pos));
+        pos = comma + 1;
+    }
+    return items;
+}
+
+bool parse_options(int argc, char *argv[], Options &opts)
+{
+    int c = 0;
+    while ((c = getopt(argc, argv, "f:t:q:p:l:h")) != -1) {
+        switch (c) {
+            case 'f':
+                opts.path = optarg;
+                break;
+            case 't':
+                opts.threads.clear();
+                for (auto &item : split(optarg)) {
+                    size_t num = strtoull(item.c_str(), nullptr, 10);
+                    if (num == 0) {
+                        return false;
+                    }
+                    opts.threads.push_back(num);
+                }
+                break;
+            case 'q':
+                opts.queues.clear();
+                for (auto &item : split(optarg)) {
+                    opts.queues.push_back(strtoull(item.c_str(), nullptr, 10));
+                }
+                break;
+            case 'p':
+                opts.policies.clear();
+                for (auto &item : split(optarg)) {
+                    if (item == "fifo") {
+                        opts.policies.push_back(tp_ns::SimConfig::FIFO);
+                    } else if (item == "priority") {
+                        opts.policies.push_back(tp_ns::SimConfig::PRIORITY);
+                    } else {
+                        return false;
+                    }
+                }
+                break;
+            case 'l':
+                opts.scales.clear();
+                for (auto &item : split(optarg)) {
+                    double scale = atof(item.c_str());
+                    if (scale <= 0) {
+                        return false;
+                    }
+                    opts.scales.push_back(scale);
+                }
+                break;
+            default:
+                return false;
+        }
+    }
+    return opts.path != nullptr;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    Options opts;
+    if (!parse_options(argc, argv, opts)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<tp_ns::TaskArrival> arrivals;
+    size_t dropped = 0;
+    if (!tp_ns::PoolSimulator::load(opts.path, &arrivals, &dropped)) {
+        std::cerr << "Failed to read the trace " << opts.path << std::endl;
+        return 1;
+    }
+    if (dropped > 0) {
+        std::cerr << "Warning: the trace is truncated, " << dropped
+                  << " arrivals beyond its capacity were dropped" << std::endl;
+    }
+    tp_ns::PoolSimulator simulator(arrivals);
+
+    printf("%8s %8s %10s %6s %10s %10s %10s %10s %10s %8s\n", "threads", "queue", "policy",
+            "load", "rejected", "p50_us", "p99_us", "p99.9_us", "max_us", "util_%");
+    for (double scale : opts.scales) {
+        for (auto policy : opts.policies) {
+            for (size_t queue : opts.queues) {
+                for (size_t threads : opts.threads) {
+                    tp_ns::SimConfig config;
+                    config.threads    = threads;
+                    config.max_tasks  = queue;
+                    config.policy     = policy;
+                    config.load_scale = scale;
+                    tp_ns::SimResult result = simulator.run(config);
+
+                    printf("%8zu %8zu %10s %6.2f %10zu %10.1f %10.1f %10.1f %10.1f %8.1f\n",
+                            threads, queue,
+                            policy == tp_ns::SimConfig::FIFO ? "fifo" : "priority", scale,
+                            result.rejected, result.p50_wait_ns / 1e3,
+                            result.p99_wait_ns / 1e3, result.p999_wait_ns / 1e3,
+                            result.max_wait_ns / 1e3, result.utilization * 100);
+                }
+            }
+        }
+    }
+    return 0;
+}
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
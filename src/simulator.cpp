@@ -0,0 +1,179 @@
+/**
+ * A thread pool framework
+ * Copyright 2017 (c), Oshyn Song (dualyangsong@gmail.com)
+ *
+ * @file    simulator.cpp
+ * @author  Oshyn Song
+ * @time    2017.8
+ */
+#include "simulator.h"
+
+#include <stdlib.h>
+
+#include <algorithm>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
+#include <queue>
+#include <sstream>
+
+BEGIN_NAMESPACE
+
+namespace {
+
+const unsigned long long NEVER = std::numeric_limits<unsigned long long>::max();
+
+unsigned long long percentile(const std::vector<unsigned long long> &sorted, double q)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = static_cast<size_t>(q * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+} // namespace
+
+PoolSimulator::PoolSimulator(const std::vector<TaskArrival> &arrivals) : _arrivals(arrivals)
+{
+    std::stable_sort(_arrivals.begin(), _arrivals.end(),
+            [](const TaskArrival &a, const TaskArrival &b) -> bool
+            {return a.enqueue_ns < b.enqueue_ns;});
+
+    // The rejected tasks never ran, so take the mean of the same name, or
+    // of all if none of the name ran
+    std::map<std::string, std::pair<unsigned long long, size_t>> runs;
+    unsigned long long total_ns = 0;
+    size_t total = 0;
+    for (auto &arrival : _arrivals) {
+        if (!arrival.rejected) {
+            auto &run = runs[arrival.name];
+            run.first += arrival.run_ns;
+            ++run.second;
+            total_ns += arrival.run_ns;
+            ++total;
+        }
+    }
+    for (auto &arrival : _arrivals) {
+        if (arrival.rejected) {
+            auto it = runs.find(arrival.name);
+            if (it != runs.end()) {
+                arrival.run_ns = it->second.first / it->second.second;
+            } else if (total > 0) {
+                arrival.run_ns = total_ns / total;
+            }
+        }
+    }
+}
+
+bool PoolSimulator::load(const char *path, std::vector<TaskArrival> *arrivals, size_t *dropped)
+{
+    std::ifstream is(path);
+    if (!is) {
+        return false;
+    }
+
+    if (dropped != nullptr) {
+        *dropped = 0;
+    }
+    std::string line;
+    while (std::getline(is, line)) {
+        if (line.empty() || line[0] == '#') {
+            if (dropped != nullptr && line.compare(0, 10, "# dropped ") == 0) {
+                *dropped = strtoull(line.c_str() + 10, nullptr, 10);
+            }
+            continue;
+        }
+        std::istringstream fields(line);
+        TaskArrival arrival;
+        if (!(fields >> arrival.enqueue_ns >> arrival.priority >> arrival.run_ns
+                     >> arrival.rejected)) {
+            return false;
+        }
+        std::getline(fields >> std::ws, arrival.name);
+        arrivals->push_back(arrival);
+    }
+    return true;
+}
+
+SimResult PoolSimulator::run(const SimConfig &config) const
+{
+    SimResult result = SimResult();
+    if (_arrivals.empty()) {
+        return result;
+    }
+
+    // Arrival times from the first one, compressed by the load scale
+    double scale = config.load_scale > 0 ? config.load_scale : 1.0;
+    std::vector<unsigned long long> times(_arrivals.size());
+    for (size_t i = 0; i < _arrivals.size(); ++i) {
+        times[i] = static_cast<unsigned long long>(
+            (_arrivals[i].enqueue_ns - _arrivals[0].enqueue_ns) / scale);
+    }
+
+    size_t threads = config.threads > 0 ? config.threads : 1;
+    std::priority_queue<unsigned long long, std::vector<unsigned long long>,
+                        std::greater<unsigned long long>> finishes;
+    std::deque<size_t> queues[Task::HIGH + 1];
+    size_t queued = 0;
+    size_t next = 0;
+    unsigned long long now = 0;
+    unsigned long long busy_ns = 0;
+    std::vector<unsigned long long> waits;
+    waits.reserve(_arrivals.size());
+
+    for (;;) {
+        // The idle threads take the queued tasks at once
+        while (finishes.size() < threads && queued > 0) {
+            int level = Task::HIGH;
+            while (queues[level].empty()) {
+                --level;
+            }
+            size_t index = queues[level].front();
+            queues[level].pop_front();
+            --queued;
+
+            waits.push_back(now - times[index]);
+            busy_ns += _arrivals[index].run_ns;
+            finishes.push(now + _arrivals[index].run_ns);
+        }
+
+        unsigned long long arrival = (next < times.size()) ? times[next] : NEVER;
+        unsigned long long finish = finishes.empty() ? NEVER : finishes.top();
+        if (arrival == NEVER && finish == NEVER) {
+            break;
+        }
+
+        // A thread finishing at the same time is idle for the arrival
+        if (finish <= arrival) {
+            now = finish;
+            finishes.pop();
+            continue;
+        }
+
+        now = arrival;
+        if (config.max_tasks > 0 && queued >= config.max_tasks) {
+            ++result.rejected;
+        } else {
+            int priority = std::max(0, std::min<int>(_arrivals[next].priority, Task::HIGH));
+            queues[config.policy == SimConfig::PRIORITY ? priority : 0].push_back(next);
+            ++queued;
+        }
+        ++next;
+    }
+
+    std::sort(waits.begin(), waits.end());
+    result.tasks        = waits.size();
+    result.p50_wait_ns  = percentile(waits, 0.5);
+    result.p99_wait_ns  = percentile(waits, 0.99);
+    result.p999_wait_ns = percentile(waits, 0.999);
+    result.max_wait_ns  = waits.empty() ? 0 : waits.back();
+    result.makespan_ns  = now;
+    result.utilization  = now > 0 ? static_cast<double>(busy_ns) / (now * threads) : 0;
+    return result;
+}
+
+END_NAMESPACE
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
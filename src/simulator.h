@@ -0,0 +1,70 @@
+/**
+ * A thread pool framework
+ * Copyright 2017 (c), Oshyn Song (dualyangsong@gmail.com)
+ *
+ * @file    simulator.h
+ * @author  Oshyn Song
+ * @time    2017.8
+ */
+#ifndef THREADPOOL_SIMULATOR_H
+#define THREADPOOL_SIMULATOR_H
+
+#include <vector>
+
+#include "common.h"
+#include "taskstats.h"
+
+BEGIN_NAMESPACE
+
+struct SimConfig {
+    enum QueuePolicy {
+        FIFO,      // In the order of arrival
+        PRIORITY   // HIGH first, FIFO in each priority, as ThreadPool
+    };
+
+    SimConfig() : threads(4), max_tasks(0), policy(PRIORITY), load_scale(1.0) {}
+
+    size_t      threads;
+    size_t      max_tasks;   // Queued tasks over which add_task fails, 0 for no limit
+    QueuePolicy policy;
+    double      load_scale;  // 2.0 replays the arrivals twice as fast
+};
+
+struct SimResult {
+    size_t             tasks;     // Run, not rejected
+    size_t             rejected;
+    unsigned long long p50_wait_ns;
+    unsigned long long p99_wait_ns;
+    unsigned long long p999_wait_ns;
+    unsigned long long max_wait_ns;
+    unsigned long long makespan_ns;
+    double             utilization;  // Busy time of the threads over the makespan
+};
+
+/**
+ * Replays an arrival trace recorded by TaskStats::record_arrivals()
+ * against a pool of the given threads, queue limit and policy, with the
+ * recorded run time of each task. The tasks rejected when recorded are
+ * replayed too, with the mean run time of their name. The dispatching
+ * itself costs nothing, so the waits predicted are the lower bound.
+ */
+class PoolSimulator {
+public:
+    explicit PoolSimulator(const std::vector<TaskArrival> &arrivals);
+
+    // Read the file written by TaskStats::dump_arrivals(), with the number
+    // of arrivals dropped from it for the capacity
+    static bool load(const char *path, std::vector<TaskArrival> *arrivals,
+                     size_t *dropped=nullptr);
+
+    SimResult run(const SimConfig &config) const;
+
+    size_t get_arrival_num() const { return _arrivals.size(); }
+
+private:
+    std::vector<TaskArrival> _arrivals;
+};
+
+END_NAMESPACE
+#endif
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,161 @@
+/**
+ * A thread pool framework
+ * Copyright 2017 (c), Oshyn Song (dualyangsong@gmail.com)
+ *
+ * @file    strand.cpp
+ * @author  Oshyn Song
+ * @time    2017.8
+ */
+#include "strand.h"
+#include "taskstats.h"
+#include "threadpool.h"
+
+#include <cstdint>
+
+BEGIN_NAMESPACE
+
+// The only task of a strand ever submitted to the pool
+class Strand::Runner : public Task {
+public:
+    explicit Runner(Strand *strand) : _strand(strand)
+    {
+        set_tname("Strand");
+    }
+
+    int run(void *) override
+    {
+        // Run by whoever takes it first, wait() takes over the runner
+        // dispatched to a worker when the pool is shut down meanwhile
+        _strand->_mutex.lock();
+        if (_strand->_state != QUEUED && _strand->_state != HANDED) {
+            _strand->_mutex.unlock();
+            return 0;
+        }
+        _strand->_state = RUNNING;
+        _strand->run_queued();
+        return 0;
+    }
+
+private:
+    Strand * _strand;
+};
+
+Strand::Strand(ThreadPool *pool)
+    : _pool(pool), _runner(nullptr), _pending(0), _state(IDLE), _entries("Strand::tasks", true), _mutex("Strand"), _cond(&_mutex)
+{
+    _runner = new Runner(this);
+}
+
+Strand::~Strand()
+{
+    wait();
+    delete _runner;
+    _runner = nullptr;
+    _pool = nullptr;
+}
+
+bool Strand::add_task(Task *task, void *arg, bool need_clear)
+{
+    if (task == nullptr || _pool->is_shutdown() || !TaskQueue::claim(task)) {
+        return false;
+    }
+
+    // Entered before counted, so the runner finds every task it counts
+    stats_enqueue(task);
+    _entries.enter(task, arg, need_clear);
+    if (_pending++ != 0) {
+        return true;
+    }
+
+    // Whoever makes the strand non-empty schedules the runner, or runs it
+    // if the pool is full
+    _mutex.lock();
+    bool run_inline = !schedule();
+    if (run_inline) {
+        _state = HANDED;
+    }
+    _cond.broadcast();  // wait() may take the runner back now
+    _mutex.unlock();
+
+    if (run_inline) {
+        _pool->run_inline(_runner, nullptr);
+    }
+    return true;
+}
+
+void Strand::wait()
+{
+    _mutex.lock();
+    while (_pending.load() != 0) {
+        // Take the runner back each time it is queued, as the pool may not
+        // dispatch it before long. The one dropped by the pool shutdown is
+        // neither queued nor running, and taken over as well.
+        if (_state == QUEUED && (_pool->remove_task(_runner) || _pool->is_shutdown())) {
+            _state = HANDED;
+            _mutex.unlock();
+            _pool->run_inline(_runner, nullptr);
+            _mutex.lock();
+            continue;
+        }
+
+        // Running, dispatched to a worker and about to run, or about to be
+        // scheduled by add_task()
+        _cond.wait();
+    }
+    _mutex.unlock();
+}
+
+// Keyed by the strand, so it tends to run on the same worker
+bool Strand::schedule()
+{
+    unsigned long long key = reinterpret_cast<uintptr_t>(this);
+    if (!_pool->add_keyed_task(_runner, nullptr, key)) {
+        return false;
+    }
+    _state = QUEUED;
+    return true;
+}
+
+// Called with the lock by the taker of the runner. Run one queued task,
+// then requeue the runner to be fair to other tasks.
+void Strand::run_queued()
+{
+    do {
+        _mutex.unlock();
+
+        // Counted, but the task entered after it may not be linked yet
+        void *arg = nullptr;
+        bool need_clear = false;
+        Task *task = nullptr;
+        while ((task = _entries.leave(&arg, &need_clear)) == nullptr) {
+            cpu_relax();
+        }
+
+        // Counted under the name of the task, not of the runner
+        task->set_executor(_runner->get_executor());
+        TaskStats::Sample sample;
+        bool measured = stats_begin(task, &sample, false);
+        task->run(arg);
+        if (measured) {
+            TaskStats::end(sample);
+        }
+        if (need_clear) {
+            delete task;
+        }
+
+        // Requeued under the lock, so wait() finds the runner either queued
+        // or running
+        _mutex.lock();
+    } while (--_pending != 0 && !schedule());
+
+    if (_state == RUNNING) {
+        _state = IDLE;
+    }
+    _cond.broadcast();
+
+    // The strand may be destructed right after, do not touch it anymore
+    _mutex.unlock();
+}
+
+END_NAMESPACE
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,77 @@
+/**
+ * A thread pool framework
+ * Copyright 2017 (c), Oshyn Song (dualyangsong@gmail.com)
+ *
+ * @file    strand.h
+ * @author  Oshyn Song
+ * @time    2017.8
+ */
+#ifndef THREADPOOL_STRAND_H
+#define THREADPOOL_STRAND_H
+
+#include <atomic>
+
+#include "common.h"
+#include "util.h"
+#include "task.h"
+#include "threadpool.h"
+
+BEGIN_NAMESPACE
+
+/**
+ * Serial executor on a pool: the tasks added to one strand run one at a
+ * time in FIFO order, maybe on different workers, while different strands
+ * run in parallel. No worker waits for a strand, at most one task of it
+ * is in the pool at any time. The tasks are linked into a lock-free FIFO
+ * TaskQueue and counted by an atomic, so adding to a busy strand takes no
+ * lock. The lock is only taken by the one which makes the strand non-empty
+ * to schedule the runner, by the runner between the tasks, and by wait().
+ */
+class Strand {
+public:
+    explicit Strand(ThreadPool *pool);
+
+    // Wait for the unfinished tasks
+    ~Strand();
+
+    // No copying
+    Strand(const Strand &) = delete;
+    Strand &operator=(const Strand &) = delete;
+
+    // Return false if the pool is shutdown, or the task is queued already.
+    // If the pool is full, the caller runs the queued tasks of the strand
+    // by itself.
+    bool add_task(Task *, void *arg=nullptr, bool need_clear=false);
+
+    // Block until all tasks of the strand finished, the caller runs them
+    // while the runner is queued. Must not be called by a task of this
+    // strand, nor while the pool is being shut down.
+    void wait();
+
+    size_t get_pending_num() const { return _pending.load(); }
+
+private:
+    class Runner;
+
+    enum RunnerState {
+        IDLE,
+        QUEUED,   // Added to the pool, not taken yet
+        HANDED,   // To be run inline by a caller
+        RUNNING   // Taken by a worker or a caller
+    };
+
+    bool schedule();
+    void run_queued();
+
+    ThreadPool *             _pool;
+    Runner *                 _runner;
+    std::atomic<size_t>      _pending;  // Added and not finished, entered first
+    RunnerState              _state;
+    TaskQueue                _entries;  // Left by the runner only
+    Mutex                    _mutex;
+    Condition                _cond;
+};
+
+END_NAMESPACE
+#endif
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
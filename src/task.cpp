@@ -7,6 +7,7 @@
  * @time    2017.6
  */
 #include "task.h"
+#include "util.h"
 
 BEGIN_NAMESPACE
 
@@ -16,9 +17,14 @@ unsigned long long g_task_max_id_cache_num = 100;
 task_id_t Task::_cur_tid = 0;
 std::unordered_map<task_id_t , bool> Task::_asigned_tids;
 
-Task::Task() : _tid(0), _tname(nullptr), _executor(nullptr), _priority(NORMAL)
+// Tasks may be created and destroyed concurrently by different producers
+static Mutex s_tid_mutex("Task::tid");
+
+Task::Task() : _tid(0), _tname(nullptr), _executor(nullptr), _priority(NORMAL), _link(this),
+    _enqueue_ns(0)
 {
     // Maintain the tid facility
+    s_tid_mutex.lock();
     task_id_t avaliable_tid = 0;
     for (auto it = _asigned_tids.cbegin(); it != _asigned_tids.cend(); ++it) {
         if (!it->second) {
@@ -34,6 +40,7 @@ Task::Task() : _tid(0), _tname(nullptr), _executor(nullptr), _priority(NORMAL)
 
     _tid = avaliable_tid;
     _asigned_tids[_tid] = true;
+    s_tid_mutex.unlock();
 }
 
 Task::~Task()
@@ -45,6 +52,7 @@ Task::~Task()
         _executor = nullptr;
     }
 
+    s_tid_mutex.lock();
     if (_asigned_tids.count(_tid) > 0) {
         if (_asigned_tids.size() > g_task_max_id_cache_num) {
             _asigned_tids.erase(_tid);
@@ -53,6 +61,7 @@ Task::~Task()
             _asigned_tids[_tid] = false;
         }
     }
+    s_tid_mutex.unlock();
 }
 
 task_id_t Task::get_tid() const
@@ -9,6 +9,7 @@
 #ifndef THREADPOOL_TASK_H
 #define THREADPOOL_TASK_H
 
+#include <atomic>
 #include <unordered_map>
 
 #include "common.h"
@@ -18,6 +19,20 @@ BEGIN_NAMESPACE
 using task_id_t = unsigned long long;
 
 class Thread;
+class Task;
+
+// Link of the intrusive task queues, a task is in one queue at most. The
+// arg and the clear flag are kept along, so queuing allocates nothing.
+struct TaskLink {
+    explicit TaskLink(Task *t=nullptr)
+        : next(nullptr), task(t), arg(nullptr), need_clear(false), queued(false) {}
+
+    std::atomic<TaskLink*> next;
+    Task *                 task;        // nullptr for the stub of a queue
+    void *                 arg;
+    bool                   need_clear;  // Deleted by the pool once run
+    std::atomic<bool>      queued;      // Claimed for a queue until it leaves
+};
 
 /**
  *
@@ -38,6 +53,7 @@ public:
 
     task_id_t get_tid() const;
 
+    // Not copied, TaskStats and Tracer keep the pointer
     void set_tname(const char *);
     const char *get_tname() const;
 
@@ -52,6 +68,11 @@ private:
     const char *     _tname;
     Thread *         _executor;
     Priority         _priority;
+    TaskLink         _link;
+    unsigned long long _enqueue_ns;
+
+    friend class TaskQueue;
+    friend class TaskStats;
 
     static task_id_t _cur_tid;
     static std::unordered_map<task_id_t, bool> _asigned_tids;
@@ -0,0 +1,151 @@
+/**
+ * A thread pool framework
+ * Copyright 2017 (c), Oshyn Song (dualyangsong@gmail.com)
+ *
+ * @file    taskgroup.cpp
+ * @author  Oshyn Song
+ * @time    2017.8
+ */
+#include "taskgroup.h"
+#include "threadpool.h"
+
+#include <algorithm>
+
+BEGIN_NAMESPACE
+
+// Wrapper task which reports the completion to its group
+class TaskGroup::GroupTask : public Task {
+public:
+    GroupTask(TaskGroup *group, Task *task, void *arg, bool need_clear)
+        : _group(group), _task(task), _arg(arg), _need_clear(need_clear), _taken(false)
+    {
+        set_tname(task->get_tname());
+        set_priority(task->get_priority());
+    }
+
+    int run(void *) override
+    {
+        // Run once, by a worker or by the waiter taking over after shutdown
+        if (_taken.exchange(true)) {
+            return 0;
+        }
+        _task->set_executor(get_executor());
+        int ret = _task->run(_arg);
+        if (_need_clear) {
+            delete _task;
+            _task = nullptr;
+        }
+
+        // The group may be destructed right after, do not touch it anymore
+        _group->finish(ret);
+        return ret;
+    }
+
+    bool is_taken() const { return _taken.load(); }
+
+private:
+    TaskGroup *       _group;
+    Task *            _task;
+    void *            _arg;
+    bool              _need_clear;
+    std::atomic<bool> _taken;
+};
+
+TaskGroup::TaskGroup(ThreadPool *pool)
+    : _pool(pool), _pending(0), _failed(0), _members(), _mutex("TaskGroup"), _cond(&_mutex)
+{
+    // Nothing to do
+}
+
+TaskGroup::~TaskGroup()
+{
+    wait();
+    _pool = nullptr;
+}
+
+bool TaskGroup::add_task(Task *task, void *arg, bool need_clear)
+{
+    if (task == nullptr) {
+        return false;
+    }
+
+    // Count before submitting, the task may finish before add_task returns
+    GroupTask *member = new GroupTask(this, task, arg, need_clear);
+    _mutex.lock();
+    _members.push_back(member);
+    ++_pending;
+    _mutex.unlock();
+
+    if (_pool->add_task(member)) {
+        return true;
+    }
+
+    _mutex.lock();
+    _members.erase(std::find(_members.begin(), _members.end(), member));
+    if (--_pending == 0) {
+        _cond.broadcast();
+    }
+    _mutex.unlock();
+    delete member;
+    return false;
+}
+
+void TaskGroup::wait()
+{
+    _mutex.lock();
+    std::vector<GroupTask*> members(_members);
+    _mutex.unlock();
+
+    // Help instead of waiting for the pool to dispatch the queued ones. The
+    // ones dropped by the pool shutdown are never run by it, run them too.
+    for (auto member : members) {
+        if (_pending.load() == 0) {
+            break;
+        }
+        if (_pool->remove_task(member) || (_pool->is_shutdown() && !member->is_taken())) {
+            _pool->run_inline(member, nullptr);
+        }
+    }
+
+    // A worker waiting for its subtasks keeps running the other queued tasks,
+    // or all the workers may end up blocked by each other
+    if (_pool->is_own_worker() && !_pool->is_shutdown()) {
+        _pool->help_until(&TaskGroup::is_done, this);
+    }
+
+    _mutex.lock();
+    while (_pending.load() > 0) {
+        _cond.wait();
+    }
+    for (auto member : _members) {
+        delete member;
+    }
+    _members.clear();
+    _mutex.unlock();
+}
+
+bool TaskGroup::is_done(void *group)
+{
+    return static_cast<TaskGroup *>(group)->_pending.load() == 0;
+}
+
+void TaskGroup::finish(int ret)
+{
+    if (ret != 0) {
+        ++_failed;
+    }
+
+    // Decrease under the lock, or the waiter may see zero and destruct the
+    // group before the mutex is released here
+    _mutex.lock();
+    if (--_pending == 0) {
+        _cond.broadcast();
+
+        // The waiter may be helping the pool instead
+        _pool->wake_helpers();
+    }
+    _mutex.unlock();
+}
+
+END_NAMESPACE
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
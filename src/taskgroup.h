@@ -0,0 +1,68 @@
+/**
+ * A thread pool framework
+ * Copyright 2017 (c), Oshyn Song (dualyangsong@gmail.com)
+ *
+ * @file    taskgroup.h
+ * @author  Oshyn Song
+ * @time    2017.8
+ */
+#ifndef THREADPOOL_TASKGROUP_H
+#define THREADPOOL_TASKGROUP_H
+
+#include <atomic>
+#include <vector>
+
+#include "common.h"
+#include "util.h"
+#include "task.h"
+
+BEGIN_NAMESPACE
+
+class ThreadPool;
+
+/**
+ * A batch of tasks submitted to a pool which can be waited for on its own,
+ * without draining or stopping the whole pool.
+ */
+class TaskGroup {
+public:
+    explicit TaskGroup(ThreadPool *pool);
+
+    // Wait for the unfinished tasks
+    ~TaskGroup();
+
+    // No copying
+    TaskGroup(const TaskGroup &) = delete;
+    TaskGroup &operator=(const TaskGroup &) = delete;
+
+    // Same as ThreadPool::add_task, the task is counted by the group
+    bool add_task(Task *, void *arg=nullptr, bool need_clear=false);
+
+    // Block until all tasks of the group finished, the ones still queued in
+    // the pool or dropped by its shutdown are run inline by the caller. If
+    // called from a worker of the pool, the other queued tasks are run while
+    // waiting. Must not be called while the pool is being shut down.
+    void wait();
+
+    size_t get_pending_num() const { return _pending.load(); }
+    size_t get_failed_num() const { return _failed.load(); }
+
+private:
+    class GroupTask;
+
+    static bool is_done(void *group);
+    void finish(int ret);
+
+    ThreadPool *             _pool;
+    std::atomic<size_t>      _pending;
+    std::atomic<size_t>      _failed;
+
+    // Wrappers of the added tasks, recycled by wait()
+    std::vector<GroupTask*>  _members;
+    Mutex                    _mutex;
+    Condition                _cond;
+};
+
+END_NAMESPACE
+#endif
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,299 @@
+/**
+ * A thread pool framework
+ * Copyright 2017 (c), Oshyn Song (dualyangsong@gmail.com)
+ *
+ * @file    taskstats.cpp
+ * @author  Oshyn Song
+ * @time    2017.8
+ */
+#include "taskstats.h"
+#include "util.h"
+
+#include <time.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <unordered_map>
+
+BEGIN_NAMESPACE
+
+std::atomic<bool> TaskStats::s_enabled(false);
+std::atomic<size_t> TaskStats::s_arrival_capacity(0);
+std::atomic<size_t> TaskStats::s_arrival_num(0);
+std::atomic<size_t> TaskStats::s_arrival_dropped(0);
+
+namespace {
+
+struct NameCounters {
+    unsigned long long count;
+    unsigned long long wall_ns;
+    unsigned long long cpu_ns;
+    unsigned long long wait_ns;
+};
+
+struct ArrivalRecord {
+    unsigned long long enqueue_ns;
+    unsigned long long run_ns;
+    int                priority;
+    bool               rejected;
+    const char *       name;
+};
+
+// Keyed by the name pointer, the lock is only contended while merging
+struct StatsTable {
+    Mutex                                              mutex;
+    std::unordered_map<const char *, NameCounters>     names;
+    std::vector<ArrivalRecord>                         arrivals;
+};
+
+// Tables outlive their threads so that the finished workers still count
+Mutex                     s_tables_mutex;
+std::vector<StatsTable*> *s_tables = new std::vector<StatsTable*>();
+thread_local StatsTable * s_table = nullptr;
+
+// Innermost sample running on the thread, the nested ones link to it
+thread_local TaskStats::Sample *s_sample = nullptr;
+
+StatsTable *get_table()
+{
+    if (s_table == nullptr) {
+        s_table = new StatsTable();
+        s_tables_mutex.lock();
+        s_tables->push_back(s_table);
+        s_tables_mutex.unlock();
+    }
+    return s_table;
+}
+
+unsigned long long get_thread_cpu_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return static_cast<unsigned long long>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+unsigned long long get_sort_value(const TaskNameStats &st, TaskStats::SortKey key)
+{
+    switch (key) {
+        case TaskStats::CPU:
+            return st.cpu_ns;
+        case TaskStats::WAIT:
+            return st.wait_ns;
+        case TaskStats::COUNT:
+            return st.count;
+        default:
+            return st.wall_ns;
+    }
+}
+
+} // namespace
+
+void TaskStats::enable(bool enabled)
+{
+    s_enabled.store(enabled);
+}
+
+void TaskStats::mark_enqueued(Task *task)
+{
+    task->_enqueue_ns = get_monotonic_ns();
+}
+
+void TaskStats::mark_rejected(const Task *task)
+{
+    if (!reserve_arrival()) {
+        return;
+    }
+
+    StatsTable *table = get_table();
+    table->mutex.lock();
+    table->arrivals.push_back(ArrivalRecord{get_monotonic_ns(), 0, task->get_priority(), true,
+                                            task->get_tname()});
+    table->mutex.unlock();
+}
+
+bool TaskStats::reserve_arrival()
+{
+    size_t capacity = s_arrival_capacity.load(std::memory_order_relaxed);
+    if (capacity == 0) {
+        return false;
+    }
+    // One count for all the threads, so that they stop at the same time
+    if (s_arrival_num.fetch_add(1, std::memory_order_relaxed) < capacity) {
+        return true;
+    }
+    s_arrival_dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+void TaskStats::begin(const Task *task, Sample *sample, bool arrival)
+{
+    begin(task->get_tname(), sample);
+    sample->priority = task->get_priority();
+    sample->arrival  = arrival;
+
+    // Not stamped if added before enabling or out of the pool
+    unsigned long long enqueue_ns = task->_enqueue_ns;
+    sample->wait_ns = (enqueue_ns != 0 && enqueue_ns < sample->start_ns) ?
+        sample->start_ns - enqueue_ns : 0;
+}
+
+void TaskStats::begin(const char *name, Sample *sample)
+{
+    sample->name          = name;
+    sample->priority      = Task::NORMAL;
+    sample->arrival       = false;
+    sample->wait_ns       = 0;
+    sample->start_ns      = get_monotonic_ns();
+    sample->start_cpu_ns  = get_thread_cpu_ns();
+    sample->nested_ns     = 0;
+    sample->nested_cpu_ns = 0;
+    sample->nested_run_ns = 0;
+    sample->parent        = s_sample;
+    s_sample = sample;
+}
+
+void TaskStats::end(const Sample &sample)
+{
+    unsigned long long wall = get_monotonic_ns() - sample.start_ns;
+    unsigned long long cpu = get_thread_cpu_ns() - sample.start_cpu_ns;
+
+    // The outer sample counts only the time of its own, and the arrival
+    // replayed by the simulator not the nested arrivals replayed as well
+    unsigned long long run = wall - sample.nested_run_ns;
+    s_sample = sample.parent;
+    if (sample.parent != nullptr) {
+        sample.parent->nested_ns     += wall;
+        sample.parent->nested_cpu_ns += cpu;
+        sample.parent->nested_run_ns += sample.arrival ? wall : sample.nested_run_ns;
+    }
+
+    bool keep = sample.arrival && reserve_arrival();
+
+    StatsTable *table = get_table();
+    table->mutex.lock();
+    NameCounters &c = table->names[sample.name];
+    ++c.count;
+    c.wall_ns += wall - sample.nested_ns;
+    c.cpu_ns  += cpu - sample.nested_cpu_ns;
+    c.wait_ns += sample.wait_ns;
+    if (keep) {
+        table->arrivals.push_back(ArrivalRecord{sample.start_ns - sample.wait_ns, run,
+                                                sample.priority, false, sample.name});
+    }
+    table->mutex.unlock();
+}
+
+std::vector<TaskNameStats> TaskStats::get_top(size_t n, SortKey key)
+{
+    std::map<std::string, TaskNameStats> merged;
+    s_tables_mutex.lock();
+    for (auto table : *s_tables) {
+        table->mutex.lock();
+        for (auto &item : table->names) {
+            std::string name = (item.first != nullptr) ? item.first : "(unnamed)";
+            TaskNameStats &st = merged[name];
+            st.name     = name;
+            st.count   += item.second.count;
+            st.wall_ns += item.second.wall_ns;
+            st.cpu_ns  += item.second.cpu_ns;
+            st.wait_ns += item.second.wait_ns;
+        }
+        table->mutex.unlock();
+    }
+    s_tables_mutex.unlock();
+
+    std::vector<TaskNameStats> stats;
+    for (auto &item : merged) {
+        stats.push_back(item.second);
+    }
+    std::sort(stats.begin(), stats.end(),
+            [key](const TaskNameStats &a, const TaskNameStats &b) -> bool
+            {return get_sort_value(a, key) > get_sort_value(b, key);});
+    if (n > 0 && stats.size() > n) {
+        stats.resize(n);
+    }
+    return stats;
+}
+
+void TaskStats::dump(std::ostream &os, size_t n, SortKey key)
+{
+    os << std::left << std::setw(24) << "name"
+       << std::right << std::setw(12) << "count" << std::setw(14) << "wall_us"
+       << std::setw(14) << "cpu_us" << std::setw(14) << "wait_us"
+       << std::setw(14) << "avg_wall_us" << std::setw(10) << "cpu_%" << '\n';
+    for (auto &st : get_top(n, key)) {
+        os << std::left << std::setw(24) << st.name
+           << std::right << std::setw(12) << st.count << std::setw(14) << st.wall_ns / 1000
+           << std::setw(14) << st.cpu_ns / 1000 << std::setw(14) << st.wait_ns / 1000
+           << std::setw(14) << st.wall_ns / 1000 / st.count
+           << std::setw(10) << (st.wall_ns ? st.cpu_ns * 100 / st.wall_ns : 0) << '\n';
+    }
+}
+
+void TaskStats::reset()
+{
+    s_tables_mutex.lock();
+    for (auto table : *s_tables) {
+        table->mutex.lock();
+        table->names.clear();
+        table->arrivals.clear();
+        table->mutex.unlock();
+    }
+    s_arrival_num.store(0);
+    s_arrival_dropped.store(0);
+    s_tables_mutex.unlock();
+}
+
+void TaskStats::record_arrivals(size_t capacity)
+{
+    s_arrival_capacity.store(capacity);
+}
+
+size_t TaskStats::get_dropped_arrivals()
+{
+    return s_arrival_dropped.load();
+}
+
+std::vector<TaskArrival> TaskStats::get_arrivals()
+{
+    std::vector<TaskArrival> arrivals;
+    s_tables_mutex.lock();
+    for (auto table : *s_tables) {
+        table->mutex.lock();
+        for (auto &record : table->arrivals) {
+            arrivals.push_back(TaskArrival{record.enqueue_ns, record.run_ns, record.priority,
+                                           record.rejected,
+                                           record.name != nullptr ? record.name : "(unnamed)"});
+        }
+        table->mutex.unlock();
+    }
+    s_tables_mutex.unlock();
+
+    std::stable_sort(arrivals.begin(), arrivals.end(),
+            [](const TaskArrival &a, const TaskArrival &b) -> bool
+            {return a.enqueue_ns < b.enqueue_ns;});
+    return arrivals;
+}
+
+bool TaskStats::dump_arrivals(const char *path)
+{
+    std::ofstream os(path);
+    if (!os) {
+        return false;
+    }
+    size_t dropped = get_dropped_arrivals();
+    if (dropped > 0) {
+        os << "# dropped " << dropped << '\n';
+    }
+    os << "# enqueue_ns priority run_ns rejected name\n";
+    for (auto &arrival : get_arrivals()) {
+        os << arrival.enqueue_ns << ' ' << arrival.priority << ' ' << arrival.run_ns << ' '
+           << arrival.rejected << ' ' << arrival.name << '\n';
+    }
+    return static_cast<bool>(os);
+}
+
+END_NAMESPACE
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
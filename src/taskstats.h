@@ -0,0 +1,151 @@
+/**
+ * A thread pool framework
+ * Copyright 2017 (c), Oshyn Song (dualyangsong@gmail.com)
+ *
+ * @file    taskstats.h
+ * @author  Oshyn Song
+ * @time    2017.8
+ */
+#ifndef THREADPOOL_TASKSTATS_H
+#define THREADPOOL_TASKSTATS_H
+
+#include <atomic>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "common.h"
+#include "task.h"
+
+BEGIN_NAMESPACE
+
+struct TaskNameStats {
+    std::string        name;
+    unsigned long long count;
+    unsigned long long wall_ns;
+    unsigned long long cpu_ns;   // CLOCK_THREAD_CPUTIME_ID around Task::run
+    unsigned long long wait_ns;  // From being added to the pool to the start
+};
+
+// A task of the arrival trace, replayed by PoolSimulator
+struct TaskArrival {
+    unsigned long long enqueue_ns;  // CLOCK_MONOTONIC when added
+    unsigned long long run_ns;      // Wall time of Task::run, 0 if rejected
+    int                priority;
+    bool               rejected;    // Not added, the queue was full
+    std::string        name;
+};
+
+/**
+ * Time spent per task name, summed up by each thread into a table of its
+ * own and merged on demand. Wall time much longer than the CPU time tells
+ * the task blocks. A task run inside another one, e.g. by run_inline() or
+ * by a Strand, is counted under its own name and its time is taken out of
+ * the outer one. The tables are keyed by the name pointer, so the names
+ * given by set_tname() must outlive the stats, e.g. string literals.
+ */
+class TaskStats {
+public:
+    enum SortKey {
+        WALL,
+        CPU,
+        WAIT,
+        COUNT
+    };
+
+    struct Sample {
+        const char *       name;
+        int                priority;
+        bool               arrival;       // Added to the pool, kept as an arrival
+        unsigned long long wait_ns;
+        unsigned long long start_ns;
+        unsigned long long start_cpu_ns;
+        unsigned long long nested_ns;      // Of the samples begun inside this one
+        unsigned long long nested_cpu_ns;
+        unsigned long long nested_run_ns;  // Of the arrivals begun inside this one
+        Sample *           parent;
+    };
+
+    static void enable(bool enabled);
+    static bool is_enabled()
+    {
+        return s_enabled.load(std::memory_order_relaxed);
+    }
+
+    // Called by the pool when the task is added, or not for the queue full
+    static void mark_enqueued(Task *task);
+    static void mark_rejected(const Task *task);
+
+    // Called by the thread around Task::run, nested in the sample begun
+    // last by the thread if any. Not an arrival if the task is run by
+    // another one without the pool, e.g. by a Strand.
+    static void begin(const Task *task, Sample *sample, bool arrival=true);
+    static void end(const Sample &sample);
+
+    // A part of the running task, e.g. a pipeline filter
+    static void begin(const char *name, Sample *sample);
+
+    // The top n names, all if n is 0
+    static std::vector<TaskNameStats> get_top(size_t n, SortKey key=WALL);
+    static void dump(std::ostream &os, size_t n=10, SortKey key=WALL);
+    static void reset();
+
+    // Also keep the arrival of each task run or rejected while enabled, up
+    // to capacity in all, 0 to stop. All threads stop keeping at once when
+    // full, the later arrivals are only counted. Reset by reset().
+    static void record_arrivals(size_t capacity);
+
+    // Arrivals not kept for the capacity, the trace ends early if not 0
+    static size_t get_dropped_arrivals();
+
+    // Sorted by the enqueue time, one "enqueue_ns priority run_ns rejected
+    // name" line each in the file, after a "# dropped N" line if truncated
+    static std::vector<TaskArrival> get_arrivals();
+    static bool dump_arrivals(const char *path);
+
+private:
+    // Whether the arrival fits in the capacity, counted as dropped if not
+    static bool reserve_arrival();
+
+    static std::atomic<bool>   s_enabled;
+    static std::atomic<size_t> s_arrival_capacity;
+    static std::atomic<size_t> s_arrival_num;
+    static std::atomic<size_t> s_arrival_dropped;
+};
+
+// Costs only a relaxed load if disabled
+inline void stats_enqueue(Task *task)
+{
+    if (__builtin_expect(TaskStats::is_enabled(), 0)) {
+        TaskStats::mark_enqueued(task);
+    }
+}
+
+inline void stats_reject(const Task *task)
+{
+    if (__builtin_expect(TaskStats::is_enabled(), 0)) {
+        TaskStats::mark_rejected(task);
+    }
+}
+
+inline bool stats_begin(const Task *task, TaskStats::Sample *sample, bool arrival=true)
+{
+    if (__builtin_expect(TaskStats::is_enabled(), 0)) {
+        TaskStats::begin(task, sample, arrival);
+        return true;
+    }
+    return false;
+}
+
+inline bool stats_begin(const char *name, TaskStats::Sample *sample)
+{
+    if (__builtin_expect(TaskStats::is_enabled(), 0)) {
+        TaskStats::begin(name, sample);
+        return true;
+    }
+    return false;
+}
+
+END_NAMESPACE
+#endif
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
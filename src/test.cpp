@@ -1,9 +1,27 @@
 // Test the threadpool project
 #include <iostream>
+#include <sstream>
+#include <string>
+#include <atomic>
+#include <vector>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "util.h"
 #include "thread.h"
 #include "threadpool.h"
+#include "taskgroup.h"
+#include "strand.h"
+#include "context.h"
+#include "taskstats.h"
+#include "trace.h"
+#include "journal.h"
+#include "sharedqueue.h"
+#include "pipeline.h"
+#include "simulator.h"
+#include "basicthreadpool.h"
 
 class TestTask : public tp_ns::Task {
 public:
@@ -27,10 +45,197 @@ public:
     }
 };
 
+class CountTask : public tp_ns::Task {
+public:
+    CountTask() { set_tname("CountTask"); }
+
+    int run(void *arg) override
+    {
+        std::atomic<int> *count = reinterpret_cast<std::atomic<int>*>(arg);
+        ++(*count);
+
+        // Scratch memory and counters local to the worker
+        tp_ns::WorkerContext *ctx = tp_ns::WorkerContext::current();
+        if (ctx != nullptr) {
+            int *scratch = ctx->get_arena().allocate_array<int>(64);
+            scratch[0] = ++ctx->local<int>();
+        }
+        return 0;
+    }
+};
+
+class OrderTask : public tp_ns::Task {
+public:
+    OrderTask(std::vector<int> *order, int id) : _order(order), _id(id) { set_tname("OrderTask"); }
+
+    int run(void *arg) override
+    {
+        _order->push_back(_id);
+        return 0;
+    }
+
+private:
+    std::vector<int> *_order;
+    int               _id;
+};
+
+// Forks two subtasks down to the leaves and waits for them on the worker
+class FanoutTask : public tp_ns::Task {
+public:
+    FanoutTask(tp_ns::ThreadPool *pool, int depth, std::atomic<int> *leaves)
+        : _pool(pool), _depth(depth), _leaves(leaves) {}
+
+    int run(void *arg) override
+    {
+        if (_depth == 0) {
+            ++(*_leaves);
+            return 0;
+        }
+        tp_ns::TaskGroup group(_pool);
+        for (int i = 0; i < 2; ++i) {
+            group.add_task(new FanoutTask(_pool, _depth - 1, _leaves), nullptr, true);
+        }
+        group.wait();
+        return 0;
+    }
+
+private:
+    tp_ns::ThreadPool *_pool;
+    int                _depth;
+    std::atomic<int> * _leaves;
+};
+
+class SleepTask : public tp_ns::Task {
+public:
+    SleepTask() { set_tname("SleepTask"); }
+
+    int run(void *arg) override
+    {
+        usleep(20000);
+        return 0;
+    }
+};
+
+// Runs the inner task inline, its time is not counted twice
+class OuterTask : public tp_ns::Task {
+public:
+    explicit OuterTask(tp_ns::ThreadPool *pool) : _pool(pool) { set_tname("OuterTask"); }
+
+    int run(void *arg) override
+    {
+        SleepTask inner;
+        return _pool->run_inline(&inner, nullptr);
+    }
+
+private:
+    tp_ns::ThreadPool *_pool;
+};
+
+class SchedTask : public tp_ns::Task {
+public:
+    int run(void *arg) override
+    {
+        std::atomic<int> *result = reinterpret_cast<std::atomic<int>*>(arg);
+        *result = static_cast<int>(get_executor()->get_sched_result());
+        return 0;
+    }
+};
+
+class BlockingTask : public tp_ns::Task {
+public:
+    BlockingTask() { set_tname("BlockingTask"); }
+
+    int run(void *arg) override
+    {
+        tp_ns::ThreadPool *pool = reinterpret_cast<tp_ns::ThreadPool*>(arg);
+        tp_ns::BlockingSection section = pool->blocking_section();
+        usleep(1000); // e.g. a slow disk read
+        return 0;
+    }
+};
+
+class JournalTask : public tp_ns::SerializableTask {
+public:
+    explicit JournalTask(int value) : _value(value) { set_tname("JournalTask"); }
+
+    const char *get_type() const override { return "JournalTask"; }
+    std::string serialize() const override { return std::to_string(_value); }
+
+    int run(void *arg) override
+    {
+        s_sum += _value;
+        return _value;
+    }
+
+    static tp_ns::SerializableTask *create(const std::string &data)
+    {
+        return new JournalTask(std::stoi(data));
+    }
+
+    static std::atomic<int> s_sum;
+
+private:
+    int _value;
+};
+
+std::atomic<int> JournalTask::s_sum(0);
+
+class CountFilter : public tp_ns::PipelineFilter {
+public:
+    CountFilter(Mode mode, int limit)
+        : tp_ns::PipelineFilter(mode, "CountFilter"), _next(0), _limit(limit) {}
+
+    // The input returns 1..limit, the others pass them on
+    void *process(void *item) override
+    {
+        if (item != nullptr) {
+            return item;
+        }
+        return _next < _limit ? reinterpret_cast<void*>(static_cast<intptr_t>(++_next)) : nullptr;
+    }
+
+private:
+    int _next;
+    int _limit;
+};
+
+static int s_failures = 0;
+
+// Count a failed expectation, the run exits non-zero if any
+static void check(bool ok, const char *what)
+{
+    if (!ok) {
+        std::cerr << "FAILED: " << what << std::endl;
+        ++s_failures;
+    }
+}
+
+static tp_ns::TaskNameStats stats_of(const std::string &name)
+{
+    for (auto &st : tp_ns::TaskStats::get_top(0)) {
+        if (st.name == name) {
+            return st;
+        }
+    }
+    return tp_ns::TaskNameStats{name, 0, 0, 0, 0};
+}
+
+static size_t count_of(const std::string &text, const std::string &pattern)
+{
+    size_t count = 0;
+    for (size_t pos = text.find(pattern); pos != std::string::npos;
+            pos = text.find(pattern, pos + pattern.size())) {
+        ++count;
+    }
+    return count;
+}
 
 int main(int argc, char *argv[])
 {
     TestTask tt;
+    tp_ns::TaskStats::enable(true);
+    tp_ns::TaskStats::record_arrivals(4096);
+    tp_ns::Tracer::enable();
 
     tp_ns::ThreadPool pool;
     pool.add_task(&tt); //`tt` must be definied before pool
@@ -41,6 +246,307 @@ int main(int argc, char *argv[])
     std::cout << "task num: " << pool.get_task_num() << std::endl;
 
     pool.run();
-    return 0;
+
+    // Wait for a batch of tasks without stopping the pool
+    std::atomic<int> group_count(0);
+    tp_ns::TaskGroup group(&pool);
+    for (int i = 0; i < 8; ++i) {
+        group.add_task(new CountTask(), (void*)&group_count, true);
+    }
+    group.wait();
+    check(group_count.load() == 8, "group tasks done by wait()");
+    std::cout << "group tasks done: " << group_count.load() << std::endl;
+
+    // Nested fork-join on two workers, the waiting workers run the subtasks
+    {
+        std::atomic<int> leaves(0);
+        tp_ns::ThreadPool fork_pool(2, 2, 1024);
+        tp_ns::TaskGroup fork_group(&fork_pool);
+        for (int i = 0; i < 2; ++i) {
+            fork_group.add_task(new FanoutTask(&fork_pool, 8, &leaves), nullptr, true);
+        }
+        fork_pool.run();
+        fork_group.wait();
+        check(leaves.load() == 2 * 256, "nested fork-join reaches every leaf");
+    }
+
+    // The group runs its tasks dropped by the pool shutdown
+    {
+        std::atomic<int> dropped_count(0);
+        tp_ns::ThreadPool stopped_pool(1);
+        tp_ns::TaskGroup dropped_group(&stopped_pool);
+        for (int i = 0; i < 4; ++i) {
+            dropped_group.add_task(new CountTask(), (void*)&dropped_count, true);
+        }
+        stopped_pool.shutdown(tp_ns::ThreadPool::DISCARD);
+        dropped_group.wait();
+        check(dropped_count.load() == 4, "group tasks run after the shutdown");
+    }
+
+    // A task is in the queue once at most, it may be added again once run
+    {
+        std::atomic<int> twice_count(0);
+        CountTask twice;
+        tp_ns::ThreadPool twice_pool(1);
+        check(twice_pool.add_task(&twice, (void*)&twice_count), "pool takes the task");
+        check(!twice_pool.add_task(&twice, (void*)&twice_count), "pool rejects a queued task");
+        twice_pool.run();
+        twice_pool.shutdown(tp_ns::ThreadPool::DRAIN);
+        check(twice_count.load() == 1, "task added twice runs once");
+    }
+
+    // Lock profiling of a contended pool, the condition waits reacquire the mutex
+    {
+        tp_ns::Mutex::reset_stats();
+        tp_ns::Mutex::enable_profiling(true);
+        std::atomic<int> profiled_count(0);
+        tp_ns::ThreadPool profiled_pool(4, 4, 1024);
+        profiled_pool.run();
+        for (int i = 0; i < 256; ++i) {
+            profiled_pool.add_task(new CountTask(), (void*)&profiled_count, true);
+        }
+        profiled_pool.shutdown(tp_ns::ThreadPool::DRAIN);
+
+        tp_ns::Mutex cond_mutex("test::cond");
+        tp_ns::Condition cond(&cond_mutex);
+        cond_mutex.lock();
+        cond.wait(tp_ns::make_deadline(1));
+        cond_mutex.unlock();
+        tp_ns::Mutex::enable_profiling(false);
+
+        unsigned long long task_locks = 0;
+        unsigned long long cond_locks = 0;
+        for (auto &st : tp_ns::Mutex::get_stats()) {
+            if (std::string(st.name) == "ThreadPool::tasks") {
+                task_locks = st.acquisitions;
+            } else if (std::string(st.name) == "test::cond") {
+                cond_locks = st.acquisitions;
+            }
+        }
+        check(profiled_count.load() == 256, "profiled pool tasks done");
+        check(task_locks >= 256, "profiling counts the task queue locks");
+        check(cond_locks == 2, "profiling counts the lock taken back by the wait");
+        tp_ns::Mutex::dump_stats(std::cout);
+    }
+
+    // Queue, idle strategy and capacities fixed at compile time
+    tp_ns::BasicThreadPool<tp_ns::PriorityPolicy, tp_ns::BlockingWait,
+                           tp_ns::FixedCapacity<2, 64>> basic_pool;
+    std::atomic<int> basic_count(0);
+    for (int i = 0; i < 8; ++i) {
+        check(basic_pool.add_task(new CountTask(), (void*)&basic_count, true),
+              "basic pool takes the tasks under its capacity");
+    }
+    basic_pool.run();
+    check(basic_count.load() == 8, "basic pool tasks done by run()");
+    std::cout << "basic pool tasks done: " << basic_count.load() << std::endl;
+
+    // The tasks of the same key run on the same worker
+    std::atomic<int> keyed_count(0);
+    for (unsigned long long key = 0; key < 8; ++key) {
+        check(pool.add_keyed_task(new CountTask(), (void*)&keyed_count, key, true),
+              "pool takes the keyed tasks");
+    }
+    pool.run();
+
+    // The tasks of a strand run one at a time in order, wait() runs them
+    // if the pool does not
+    {
+        std::vector<int> order;
+        tp_ns::Strand strand(&pool);
+        for (int i = 0; i < 4; ++i) {
+            strand.add_task(new OrderTask(&order, i), nullptr, true);
+        }
+        strand.wait();
+        check(order == std::vector<int>({0, 1, 2, 3}), "strand tasks run in order");
+        std::cout << "strand tasks done: " << order.size() << std::endl;
+    }
+
+    // A task is in a strand once at most, the runner waits in the idle pool
+    {
+        std::vector<int> order;
+        OrderTask twice(&order, 0);
+        tp_ns::ThreadPool idle_pool(1);
+        tp_ns::Strand strand(&idle_pool);
+        check(strand.add_task(&twice), "strand takes the task");
+        check(!strand.add_task(&twice), "strand rejects a queued task");
+        strand.wait();
+        check(order == std::vector<int>({0}), "task added twice to a strand runs once");
+    }
+
+    // The strand takes over its runner dropped by the pool shutdown
+    {
+        std::vector<int> order;
+        tp_ns::ThreadPool stopped_pool(1);
+        {
+            tp_ns::Strand strand(&stopped_pool);
+            for (int i = 0; i < 4; ++i) {
+                strand.add_task(new OrderTask(&order, i), nullptr, true);
+            }
+            stopped_pool.shutdown(tp_ns::ThreadPool::DISCARD);
+        }
+        check(order == std::vector<int>({0, 1, 2, 3}), "strand tasks run after the shutdown");
+    }
+
+    // HIGH tasks go to the real-time lane, or its nice fallback
+    std::atomic<int> sched_result(tp_ns::SchedConfig::PENDING);
+    pool.add_lane(1, tp_ns::SchedConfig(SCHED_FIFO, 1, -5));
+    SchedTask *sched_task = new SchedTask();
+    sched_task->set_priority(tp_ns::Task::HIGH);
+    pool.add_task(sched_task, (void*)&sched_result, true);
+    pool.run();
+
+    // Spare workers run the queued tasks while the others are blocked
+    pool.set_max_spare(2);
+    for (int i = 0; i < 4; ++i) {
+        pool.add_task(new BlockingTask(), (void*)&pool, true);
+    }
+    pool.run();
+
+    // Journaled tasks are replayed if the process dies before they finished
+    tp_ns::TaskJournal::register_type("JournalTask", &JournalTask::create);
+    tp_ns::TaskJournal journal("/tmp/threadpooltest.journal", 64 * 1024);
+    size_t replayed = pool.set_journal(&journal);
+    for (int i = 0; i < 4; ++i) {
+        pool.add_journaled_task(new JournalTask(i), true);
+    }
+    pool.run();
+
+    // The tasks never run are replayed by the next open, even beyond the max
+    // tasks of the pool
+    unlink("/tmp/threadpooltest-replay.journal");
+    {
+        tp_ns::TaskJournal first_run("/tmp/threadpooltest-replay.journal", 64 * 1024);
+        tp_ns::ThreadPool first_pool(1, 4, 8);
+        first_pool.set_journal(&first_run);
+        for (int i = 1; i <= 4; ++i) {
+            first_pool.add_journaled_task(new JournalTask(i), true);
+        }
+        first_pool.shutdown(tp_ns::ThreadPool::DISCARD);
+    }
+    {
+        // The journaled tasks of the main pool add to the same sum
+        while (journal.get_pending_num() > 0) {
+            usleep(1000);
+        }
+        JournalTask::s_sum = 0;
+        tp_ns::TaskJournal second_run("/tmp/threadpooltest-replay.journal", 64 * 1024);
+        tp_ns::ThreadPool second_pool(1, 4, 2);
+        check(second_pool.set_journal(&second_run) == 4, "journal replays the unrun tasks");
+        second_pool.run();
+        second_pool.shutdown(tp_ns::ThreadPool::DRAIN);
+        check(JournalTask::s_sum.load() == 1 + 2 + 3 + 4, "journal replays the task data");
+        check(second_run.get_pending_num() == 0, "journal has no pending task after replay");
+    }
+    {
+        tp_ns::TaskJournal third_run("/tmp/threadpooltest-replay.journal", 64 * 1024);
+        check(third_run.replay().empty(), "journal replays the done tasks no more");
+    }
+    unlink("/tmp/threadpooltest-replay.journal");
+
+    // Tasks pushed to the shared memory, usually by another process
+    tp_ns::SharedTaskQueue::unlink("/threadpooltest-queue");
+    tp_ns::SharedTaskQueue shared_queue("/threadpooltest-queue", 16, 64);
+    for (int i = 0; i < 4; ++i) {
+        JournalTask task(i);
+        shared_queue.push(&task);  // copied into the slot
+    }
+    size_t shared_tasks = pool.add_shared_tasks(&shared_queue, 0);
+    tp_ns::SharedTaskQueue::unlink("/threadpooltest-queue");
+
+    // A queue of a corrupt header is not opened, its slots can not be indexed
+    {
+        const uint32_t headers[][3] = {{0x31515054, 3, 64}, {0x31515054, 0, 64},
+                                       {0x31515054, 4, 8}};
+        for (auto &words : headers) {
+            int fd = shm_open("/threadpooltest-bad-queue", O_RDWR | O_CREAT | O_TRUNC, 0600);
+            if (fd >= 0 && ftruncate(fd, 4096) == 0) {
+                void *base = mmap(nullptr, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if (base != MAP_FAILED) {
+                    memcpy(base, words, sizeof(words));  // magic, slot_num, slot_size
+                    munmap(base, 4096);
+                }
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+            tp_ns::SharedTaskQueue bad_queue("/threadpooltest-bad-queue", 16, 64);
+            check(!bad_queue.is_open(), "shared queue of a corrupt header not opened");
+            tp_ns::SharedTaskQueue::unlink("/threadpooltest-bad-queue");
+        }
+    }
+    pool.run();
+
+    // Items through the filters, the serial ones in the order of the input
+    tp_ns::Pipeline pipeline(&pool);
+    pipeline.add_filter(new CountFilter(tp_ns::PipelineFilter::SERIAL, 32), true);
+    pipeline.add_filter(new CountFilter(tp_ns::PipelineFilter::PARALLEL, 0), true);
+    pipeline.add_filter(new CountFilter(tp_ns::PipelineFilter::SERIAL, 0), true);
+    check(pipeline.run(4), "pipeline runs");
+
+    // Blocking tasks run on the threads of their own
+    pool.submit_blocking(new BlockingTask(), (void*)&pool, true);
+
+    size_t stack_resident = 0;
+    for (size_t bytes : pool.get_stack_resident()) {
+        stack_resident += bytes;
+    }
+    std::cout << "stack resident: " << stack_resident << std::endl;
+
+    tp_ns::ThreadPool::ShutdownReport report = pool.shutdown(tp_ns::ThreadPool::DRAIN, 1000);
+    check(report.hung_threads == 0, "no thread hung at the shutdown");
+    check(report.unrun_tasks.empty(), "every task drained at the shutdown");
+    check(keyed_count.load() == 8, "keyed tasks done");
+    check(sched_result.load() != tp_ns::SchedConfig::PENDING, "lane task ran");
+    check(journal.get_pending_num() == 0, "journal has no pending task");
+    check(shared_tasks == 4, "shared queue tasks added");
+    check(shared_queue.get_dropped_num() == 0, "shared queue dropped no task");
+    check(pipeline.get_item_num() == 32, "pipeline items read");
+    std::cout << "shutdown joined: " << report.joined_threads
+              << ", hung: " << report.hung_threads
+              << ", unrun: " << report.unrun_tasks.size() << std::endl;
+    std::cout << "keyed tasks done: " << keyed_count.load() << std::endl;
+    std::cout << "lane sched result: " << sched_result.load() << std::endl;
+    std::cout << "journal replayed: " << replayed
+              << ", pending: " << journal.get_pending_num() << std::endl;
+    std::cout << "shared queue tasks: " << shared_tasks << std::endl;
+    std::cout << "pipeline items: " << pipeline.get_item_num() << std::endl;
+
+    // Timeline of the tasks run above, each start finished once
+    std::ostringstream timeline;
+    tp_ns::Tracer::dump(timeline);
+    size_t starts = count_of(timeline.str(), "\"ph\":\"B\"");
+    check(starts > 0 && starts == count_of(timeline.str(), "\"ph\":\"E\""),
+          "trace has a finish for each start");
+    check(count_of(timeline.str(), "\"thread_name\"") > 0, "trace names the threads");
+
+    // A task run inside another one counts under its own name only
+    {
+        tp_ns::ThreadPool nested_pool(1);
+        OuterTask outer(&nested_pool);
+        nested_pool.run_inline(&outer, nullptr);
+    }
+    tp_ns::TaskNameStats outer_stats = stats_of("OuterTask");
+    tp_ns::TaskNameStats inner_stats = stats_of("SleepTask");
+    check(outer_stats.count == 1 && inner_stats.count == 1 &&
+          inner_stats.wall_ns >= 20000000ULL && outer_stats.wall_ns < inner_stats.wall_ns,
+          "nested task time counted once");
+    check(stats_of("OrderTask").count == 9, "strand tasks counted under their names");
+    check(stats_of("CountFilter").count > 0, "pipeline filters counted under their names");
+
+    // Time spent per task name, the blocking ones spend little CPU
+    tp_ns::TaskStats::dump(std::cout, 5);
+
+    // Replay the tasks run above on a single thread
+    check(tp_ns::TaskStats::get_dropped_arrivals() == 0, "arrival trace not truncated");
+    tp_ns::PoolSimulator simulator(tp_ns::TaskStats::get_arrivals());
+    tp_ns::SimConfig config;
+    config.threads = 1;
+    tp_ns::SimResult sim = simulator.run(config);
+    check(sim.tasks > 0 && sim.tasks + sim.rejected == simulator.get_arrival_num(),
+          "simulator replays every arrival");
+    std::cout << "simulated tasks: " << sim.tasks << ", p99 wait us: " << sim.p99_wait_ns / 1000
+              << ", utilization: " << static_cast<int>(sim.utilization * 100) << "%" << std::endl;
+    return s_failures == 0 ? 0 : 1;
 }
 /* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
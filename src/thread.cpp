@@ -8,22 +8,43 @@
  */
 #include "thread.h"
 #include "task.h"
+#include "trace.h"
+#include "taskstats.h"
+#include "probes.h"
+
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <vector>
 
 BEGIN_NAMESPACE
 
+static thread_local Worker *s_current_worker = nullptr;
+
 // Static function for pthread_create interface
 void *Thread::thread_function(void *arg)
 {
     Thread *call_obj = reinterpret_cast<Thread *>(arg);
+    call_obj->init_stack();
+    call_obj->init_sched();
 
     while (true) {
         switch (call_obj->get_thread_state()) {
             case RUNNING:
                 call_obj->run();
                 call_obj->set_thread_state(SUSPENDED);
+                call_obj->suspended();
                 break;
             case SUSPENDED: // only fit in the first SUSPENDED state
+                if (call_obj->is_stop_requested()) {
+                    call_obj->exit();
+                }
+                TP_PROBE2(thread__suspend, call_obj, call_obj->get_name());
                 call_obj->suspend();
+                TP_PROBE2(thread__resume, call_obj, call_obj->get_name());
                 break;
             case DEAD:
                 call_obj->exit();
@@ -43,8 +64,9 @@ Thread::Thread() : Thread(true, false, nullptr)
 }
 
 Thread::Thread(bool create_suspend, bool detached, const char *name) : 
-    _id(), _create_suspend(create_suspend), _detached(detached),
-    _name(name), _error_code(0), _state(CREATING), _semaphore(0)
+    _id(), _create_suspend(create_suspend), _detached(detached), _started(false),
+    _name(name), _error_code(0), _state(CREATING), _stop_requested(false), _semaphore(0),
+    _stack(), _stack_low(nullptr), _stack_len(0), _sched(), _sched_result(SchedConfig::PENDING)
 {
     // Nothine to do
     if (_create_suspend) {
@@ -74,17 +96,52 @@ bool Thread::start()
     } else {
         pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
     }
+    if (_stack.stack_size != StackConfig::USE_DEFAULT) {
+        size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        size_t min = static_cast<size_t>(PTHREAD_STACK_MIN);
+        size_t size = (_stack.stack_size + page - 1) & ~(page - 1);
+        pthread_attr_setstacksize(&attr, size < min ? min : size);
+    }
+    if (_stack.guard_size != StackConfig::USE_DEFAULT) {
+        pthread_attr_setguardsize(&attr, _stack.guard_size);
+    }
 
     int status = pthread_create(&_id, &attr, Thread::thread_function,
             reinterpret_cast<void *>(this));
     pthread_attr_destroy(&attr);
 
-    return (0 == status);
+    _started = (0 == status);
+    return _started;
 }
 
+// Not started any more once joined
 bool Thread::join()
 {
-    return (0 == pthread_join(_id, NULL));
+    if (0 != pthread_join(_id, NULL)) {
+        return false;
+    }
+    _started = false;
+    return true;
+}
+
+bool Thread::join(const struct timespec &deadline)
+{
+    if (0 != pthread_timedjoin_np(_id, NULL, &deadline)) {
+        return false;
+    }
+    _started = false;
+    return true;
+}
+
+bool Thread::detach()
+{
+    _detached = true;
+    return (0 == pthread_detach(_id));
+}
+
+bool Thread::is_started() const
+{
+    return _started;
 }
 
 bool Thread::is_daemon() const
@@ -97,9 +154,78 @@ void Thread::set_daemon()
     _detached = true;
 }
 
+size_t Thread::get_stack_resident() const
+{
+    char *low = _stack_low.load();
+    size_t len = _stack_len.load();
+    if (low == nullptr || len == 0) {
+        return 0;
+    }
+
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    std::vector<unsigned char> pages((len + page - 1) / page);
+    if (mincore(low, len, pages.data()) != 0) {
+        return 0;
+    }
+
+    size_t resident = 0;
+    for (unsigned char p : pages) {
+        resident += (p & 1);
+    }
+    return resident * page;
+}
+
+void Thread::init_stack()
+{
+    pthread_attr_t attr;
+    void *addr = nullptr;
+    size_t size = 0;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        pthread_attr_getstack(&attr, &addr, &size);
+        pthread_attr_destroy(&attr);
+    }
+    _stack_low = static_cast<char *>(addr);
+    _stack_len = size;
+
+    if (addr == nullptr || _stack.prefault_size == 0) {
+        return;
+    }
+
+    // Touch the pages below the current frame, the stack grows down
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    char *frame = static_cast<char *>(__builtin_frame_address(0));
+    char *low = static_cast<char *>(addr) + page;
+    char *end = (frame - low > static_cast<long>(_stack.prefault_size)) ?
+        frame - _stack.prefault_size : low;
+    for (volatile char *p = frame - page; p >= end; p -= page) {
+        *p = 0;
+    }
+}
+
+void Thread::init_sched()
+{
+    if (_sched.policy == SCHED_FIFO || _sched.policy == SCHED_RR) {
+        sched_param sp;
+        sp.sched_priority = _sched.priority;
+        if (pthread_setschedparam(pthread_self(), _sched.policy, &sp) == 0) {
+            _sched_result = SchedConfig::REALTIME;
+            return;
+        }
+    }
+
+    // The nice value is per thread on Linux
+    pid_t tid = static_cast<pid_t>(syscall(SYS_gettid));
+    if (_sched.nice != 0 && setpriority(PRIO_PROCESS, tid, _sched.nice) == 0) {
+        _sched_result = SchedConfig::NICE;
+        return;
+    }
+    _sched_result = SchedConfig::DEFAULT;
+}
+
+// The state is left to the caller, or a resume() issued right before the
+// waiting would be overwritten and the assigned task lost
 void Thread::suspend()
 {
-    _state = SUSPENDED;
     _semaphore.wait();
 }
 
@@ -118,8 +244,20 @@ bool Thread::cancel()
     return false;
 }
 
+void Thread::request_stop()
+{
+    _stop_requested = true;
+    _semaphore.signal();
+}
+
+bool Thread::is_stop_requested() const
+{
+    return _stop_requested.load();
+}
+
 void Thread::exit()
 {
+    _stack_len = 0;
     _state = DEAD;
     pthread_exit(NULL);
 }
@@ -204,7 +342,9 @@ Worker::Worker(Task *task, void *arg) : Worker(task, arg, true, false, nullptr)
 }
 
 Worker::Worker(Task *task, void *arg, bool create_suspend, bool detached, const char *name)
-    : Thread(create_suspend, detached, name), _task(task), _task_arg(arg)
+    : Thread(create_suspend, detached, name), _task(task), _task_arg(arg), _task_clear(false),
+      _context(),
+      _source(nullptr), _source_owner(nullptr), _idle_hook(nullptr), _idle_owner(nullptr)
 {
     // Nothing to do
 }
@@ -221,16 +361,59 @@ Worker::~Worker()
 
 void Worker::run()
 {
-    if (_task == nullptr) {
-        return;
+    long index = static_cast<long>(_context.get_index());
+    WorkerContext::set_current(&_context);
+    s_current_worker = this;
+
+    while (_task != nullptr) {
+        trace_event(Tracer::START, _task, index);
+        TP_PROBE2(task__start, _task, index);
+        TaskStats::Sample sample;
+        bool measured = stats_begin(_task, &sample);
+        int ret = _task->run(_task_arg);
+        if (measured) {
+            TaskStats::end(sample);
+        }
+        trace_finish(index);
+
+        // The task may be destructed by its run(), only the address is given
+        TP_PROBE3(task__finish, _task, index, ret);
+        _context.get_arena().reset();
+
+        this->set_error_code(ret);
+        // A failed task is kept for get_task(), unless it is deleted
+        if (_task_clear) {
+            delete _task;
+        }
+        if (ret == 0 || _task_clear) {
+            _task = nullptr;
+            _task_arg = nullptr;
+            _task_clear = false;
+        }
+
+        if (_source == nullptr) {
+            break;
+        }
+        void *arg = nullptr;
+        bool need_clear = false;
+        Task *next = _source(_source_owner, this, &arg, &need_clear);
+        if (next == nullptr) {
+            break;
+        }
+        next->set_executor(this);
+        set_task(next, arg, need_clear);
     }
+}
 
-    int ret = _task->run(_task_arg);
+Worker *Worker::current()
+{
+    return s_current_worker;
+}
 
-    this->set_error_code(ret);
-    if (ret == 0) {
-        _task = nullptr;
-        _task_arg = nullptr;
+void Worker::suspended()
+{
+    if (_idle_hook != nullptr) {
+        _idle_hook(_idle_owner, this);
     }
 }
 
@@ -10,14 +10,50 @@
 #define THREADPOOL_THREAD_H
 
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include <atomic>
 
 #include "common.h"
 #include "util.h"
+#include "context.h"
 
 BEGIN_NAMESPACE
 
 class Task;
 
+// Stack of a thread, the default of pthread is used for USE_DEFAULT
+struct StackConfig {
+    static const size_t USE_DEFAULT = static_cast<size_t>(-1);
+
+    StackConfig() : stack_size(USE_DEFAULT), guard_size(USE_DEFAULT), prefault_size(0) {}
+    StackConfig(size_t stack, size_t guard=USE_DEFAULT, size_t prefault=0)
+        : stack_size(stack), guard_size(guard), prefault_size(prefault) {}
+
+    size_t stack_size;
+    size_t guard_size;
+    size_t prefault_size;  // Touched at the start to avoid page faults in tasks
+};
+
+// Scheduling of a thread applied by itself at the start, the real-time
+// policy falls back to the nice value without the permission
+struct SchedConfig {
+    enum Result {
+        PENDING,
+        REALTIME,
+        NICE,
+        DEFAULT
+    };
+
+    SchedConfig() : policy(SCHED_OTHER), priority(0), nice(0) {}
+    SchedConfig(int p, int prio, int n=0) : policy(p), priority(prio), nice(n) {}
+
+    int policy;    // SCHED_FIFO, SCHED_RR or SCHED_OTHER
+    int priority;  // For SCHED_FIFO and SCHED_RR only
+    int nice;
+};
+
 class Thread {
 public:
     enum State {
@@ -44,12 +80,32 @@ public:
     bool start();
     bool join();
 
+    // Join before the absolute CLOCK_REALTIME deadline
+    bool join(const struct timespec &deadline);
+    bool detach();
+    bool is_started() const;
+
     // Test if the thread is detached or not
     bool is_daemon() const;
 
     // Must be called before start()
     void set_daemon();
 
+    // Must be called before start(). The stack is allocated by pthread and
+    // cached by it for the next thread of the same size once joined.
+    void set_stack(const StackConfig &stack) { _stack = stack; }
+    const StackConfig &get_stack() const { return _stack; }
+
+    // Resident bytes of the stack, 0 if not started or already exited
+    size_t get_stack_resident() const;
+
+    // Must be called before start()
+    void set_sched(const SchedConfig &sched) { _sched = sched; }
+    const SchedConfig &get_sched() const { return _sched; }
+
+    // What has been applied, PENDING before the thread runs
+    SchedConfig::Result get_sched_result() const { return _sched_result.load(); }
+
     // Suspend the thread using semaphore
     void suspend();
 
@@ -59,6 +115,10 @@ public:
     // Request for cancelling by other thread
     bool cancel();
 
+    // Let the thread exit once its current task finished
+    void request_stop();
+    bool is_stop_requested() const;
+
     unsigned long get_tid() const;
     int get_last_error() const;
 
@@ -74,6 +134,13 @@ protected: // Just called by the thread self
 
     void set_error_code(int);
 
+    // Called by the thread self once run() returned and it is SUSPENDED
+    virtual void suspended() {}
+
+    // Record the stack bounds and prefault it
+    void init_stack();
+    void init_sched();
+
     int get_priority();
     void set_priority(int);
 
@@ -81,15 +148,31 @@ protected: // Just called by the thread self
     void set_concurrency(int);
 
 private:
-    pthread_t    _id;
-    bool         _create_suspend;
-    bool         _detached;
-    const char * _name;
-    int          _error_code;
-    State        _state;
-    Semaphore    _semaphore;
+    pthread_t          _id;
+    bool               _create_suspend;
+    bool               _detached;
+    bool               _started;
+    const char *       _name;
+    int                _error_code;
+    std::atomic<State> _state;
+    std::atomic<bool>  _stop_requested;
+    Semaphore          _semaphore;
+    StackConfig        _stack;
+    std::atomic<char*> _stack_low;
+    std::atomic<size_t> _stack_len;
+    SchedConfig        _sched;
+    std::atomic<SchedConfig::Result> _sched_result;
 };
 
+class Worker;
+
+// Fetch the next task for the worker once its current one finished,
+// return nullptr if there is none
+typedef Task *(*TaskSource)(void *owner, Worker *worker, void **arg, bool *need_clear);
+
+// Told when the worker has no task left and is waiting to be resumed
+typedef void (*IdleHook)(void *owner, Worker *worker);
+
 class Worker : public Thread {
 public:
     Worker();
@@ -101,12 +184,39 @@ public:
 
     void run() override;
 
-    void set_task(Task *task, void *arg=nullptr) { _task = task; _task_arg = arg; }
+    // Deleted by the worker once run if need_clear
+    void set_task(Task *task, void *arg=nullptr, bool need_clear=false)
+    {
+        _task = task;
+        _task_arg = arg;
+        _task_clear = need_clear;
+    }
     Task *get_task() const { return _task; }
 
+    // Reachable by the running task through WorkerContext::current()
+    WorkerContext &get_context() { return _context; }
+
+    // Worker running the calling thread, nullptr if the caller is not one
+    static Worker *current();
+
+    // Keep running the tasks from the source before suspending
+    void set_task_source(TaskSource source, void *owner) { _source = source; _source_owner = owner; }
+
+    // Must be called before start()
+    void set_idle_hook(IdleHook hook, void *owner) { _idle_hook = hook; _idle_owner = owner; }
+
+protected:
+    void suspended() override;
+
 private:
-    Task * _task;
-    void * _task_arg;
+    Task *        _task;
+    void *        _task_arg;
+    bool          _task_clear;
+    WorkerContext _context;
+    TaskSource    _source;
+    void *        _source_owner;
+    IdleHook      _idle_hook;
+    void *        _idle_owner;
 };
 
 inline Worker *NewWorker()
@@ -8,6 +8,12 @@
  */
 
 #include "threadpool.h"
+#include "blockingexecutor.h"
+#include "journal.h"
+#include "sharedqueue.h"
+#include "trace.h"
+#include "taskstats.h"
+#include "probes.h"
 #include <algorithm>
 #include <stdexcept>
 
@@ -17,153 +23,276 @@ unsigned long long g_threadpool_max_thread_num  = 100;
 unsigned long long g_threadpool_init_thread_num = 10;
 unsigned long long g_threadpool_max_task_num    = 100;
 
-// Definition of class IdleThreadsStack
-Thread* IdleThreadsStack::pop()
+// Definition of class WorkerBitmap
+WorkerBitmap::WorkerBitmap(size_t capacity)
+    : _bits(), _words((capacity + 63) / 64), _count(0)
 {
-    _mutex.lock();
-    Thread* top = _threads.top();
-    _threads.pop();
-    _mutex.unlock();
-
-    return top;
+    _bits.reset(new std::atomic<uint64_t>[_words]);
+    for (size_t i = 0; i < _words; ++i) {
+        _bits[i].store(0);
+    }
 }
 
-void IdleThreadsStack::push(Thread *thread)
+bool WorkerBitmap::set(size_t index)
 {
-    _mutex.lock();
-    _threads.push(thread);
-    _mutex.unlock();
+    uint64_t mask = 1ULL << (index % 64);
+    if (_bits[index / 64].fetch_or(mask) & mask) {
+        return false;
+    }
+    ++_count;
+    return true;
 }
 
-Thread* IdleThreadsStack::top() const
+bool WorkerBitmap::claim(size_t index)
 {
-    return _threads.top();
+    uint64_t mask = 1ULL << (index % 64);
+    if (!(_bits[index / 64].fetch_and(~mask) & mask)) {
+        return false;
+    }
+    --_count;
+    return true;
 }
 
-void IdleThreadsStack::clear()
+bool WorkerBitmap::claim_any(size_t *index)
 {
-    _mutex.lock();
-    while (!_threads.empty()) {
-        _threads.pop();
+    for (size_t i = 0; i < _words; ++i) {
+        uint64_t word = _bits[i].load();
+        while (word != 0) {
+            uint64_t mask = word & (~word + 1);
+            uint64_t old = _bits[i].fetch_and(~mask);
+            if (old & mask) {
+                --_count;
+                *index = i * 64 + __builtin_ctzll(mask);
+                return true;
+            }
+            word = old & ~mask;
+        }
     }
-    _mutex.unlock();
+    return false;
 }
 
-bool IdleThreadsStack::is_empty() const
+bool WorkerBitmap::test(size_t index) const
 {
-    return _threads.empty();
+    return (_bits[index / 64].load() >> (index % 64)) & 1;
 }
 
-size_t IdleThreadsStack::size() const
+void WorkerBitmap::clear()
 {
-    return _threads.size();
+    for (size_t i = 0; i < _words; ++i) {
+        _count -= __builtin_popcountll(_bits[i].exchange(0));
+    }
 }
 
-// Definition of class BusyThreadsList
-void BusyThreadsList::enter(Thread *thread)
+// Definition of class TaskQueue
+TaskQueue::TaskQueue(const char *name, bool fifo)
+    : _levels(), _mutex(name), _fifo(fifo), _size(0)
 {
-    _mutex.lock();
-    _threads.push_back(thread);
-    _mutex.unlock();
+    // Nothing to do
 }
 
-Thread *BusyThreadsList::leave()
+// Linking a queued task again would make it its own next
+bool TaskQueue::claim(Task *task)
 {
-    _mutex.lock();
-    Thread *thread = _threads.front();
-    _threads.pop_front();
-    _mutex.unlock();
-
-    return thread;
+    return !task->_link.queued.exchange(true, std::memory_order_acq_rel);
 }
 
-Thread* BusyThreadsList::front() const
+void TaskQueue::enter(Task *task, void *arg, bool need_clear)
 {
-    return _threads.front();
+    task->_link.arg        = arg;
+    task->_link.need_clear = need_clear;
+
+    // Counted before being linked, or size() may wrap around. The task may
+    // be run and deleted as soon as it is linked.
+    ++_size;
+    TP_PROBE3(task__enqueue, task, task->get_tid(), task->get_priority());
+    push(_levels[_fifo ? Task::NORMAL : task->get_priority()], &task->_link);
 }
 
-bool BusyThreadsList::exist(Thread *thread) const
+// Return nullptr if the queue has been emptied by other threads
+Task* TaskQueue::leave(void **arg, bool *need_clear)
 {
-    return std::find(_threads.begin(), _threads.end(), thread) != _threads.end();
+    return leave_if(Task::LOW, arg, need_clear);
 }
 
-void BusyThreadsList::remove(Thread *thread)
+Task* TaskQueue::leave_if(Task::Priority priority, void **arg, bool *need_clear)
 {
+    Task *task = nullptr;
     _mutex.lock();
-    _threads.erase(std::find(_threads.begin(), _threads.end(), thread));
+    for (int i = Task::HIGH; i >= priority && task == nullptr; --i) {
+        task = pop(_levels[i]);
+    }
+    if (task != nullptr) {
+        --_size;
+        TP_PROBE2(task__dequeue, task, task->get_tid());
+        release(task, arg, need_clear);
+    }
     _mutex.unlock();
+
+    return task;
 }
 
-void BusyThreadsList::clear()
+bool TaskQueue::exist(Task *task) const
 {
+    bool found = false;
     _mutex.lock();
-    _threads.clear();
+    for (int i = 0; i <= Task::HIGH && !found; ++i) {
+        TaskLink *link = _levels[i].head;
+        while (link != nullptr && link->task != task) {
+            link = link->next.load(std::memory_order_acquire);
+        }
+        found = (link != nullptr);
+    }
     _mutex.unlock();
-}
 
-bool BusyThreadsList::is_empty() const
-{
-    return _threads.empty();
+    return found;
 }
 
-size_t BusyThreadsList::size() const
+// Return false if the task is not queued (e.g. already dispatched)
+bool TaskQueue::remove(Task *task, bool *need_clear)
 {
-    return _threads.size();
+    bool found = false;
+    _mutex.lock();
+    for (int i = 0; i <= Task::HIGH && !found; ++i) {
+        TaskLink *prev = nullptr;
+        TaskLink *link = _levels[i].head;
+        while (link != nullptr && link->task != task) {
+            prev = link;
+            link = link->next.load(std::memory_order_acquire);
+        }
+        if (link != nullptr) {
+            unlink(_levels[i], prev, link);
+            --_size;
+            release(task, nullptr, need_clear);
+            found = true;
+        }
+    }
+    _mutex.unlock();
+
+    return found;
 }
 
-// Definition of class TaskQueue
-void TaskQueue::enter(Task *task)
+void TaskQueue::clear()
 {
-    auto pos = std::find_if(
-            _tasks.begin(), _tasks.end(),
-            [task](Task *t) -> bool
-            {return task->get_priority() >= t->get_priority();}
-        );
     _mutex.lock();
-    _tasks.insert(pos, task);
+    for (int i = 0; i <= Task::HIGH; ++i) {
+        Task *task = nullptr;
+        while ((task = pop(_levels[i])) != nullptr) {
+            --_size;
+            release(task, nullptr, nullptr);
+        }
+    }
     _mutex.unlock();
 }
 
-Task* TaskQueue::leave()
+bool TaskQueue::is_empty() const
 {
-    _mutex.lock();
-    Task *front = _tasks.front();
-    _tasks.pop_front();
-    _mutex.unlock();
+    return _size.load() == 0;
+}
 
-    return front;
+size_t TaskQueue::size() const
+{
+    return _size.load();
 }
 
-Task* TaskQueue::front() const
+void TaskQueue::push(Level &level, TaskLink *link)
 {
-    return _tasks.front();
+    link->next.store(nullptr, std::memory_order_relaxed);
+    TaskLink *prev = level.tail.exchange(link, std::memory_order_acq_rel);
+    prev->next.store(link, std::memory_order_release);
 }
 
-bool TaskQueue::exist(Task *task) const
+// Return nullptr if empty, or the last task entered is not linked yet
+Task *TaskQueue::pop(Level &level)
 {
-    return std::find(_tasks.begin(), _tasks.end(), task) != _tasks.end();
+    TaskLink *head = level.head;
+    TaskLink *next = head->next.load(std::memory_order_acquire);
+    if (head == &level.stub) {
+        if (next == nullptr) {
+            return nullptr;
+        }
+        level.head = next;
+        head = next;
+        next = next->next.load(std::memory_order_acquire);
+    }
+    if (next != nullptr) {
+        level.head = next;
+        return head->task;
+    }
+    if (head != level.tail.load(std::memory_order_acquire)) {
+        return nullptr;
+    }
+
+    // The last one, put the stub behind to take it
+    push(level, &level.stub);
+    next = head->next.load(std::memory_order_acquire);
+    if (next != nullptr) {
+        level.head = next;
+        return head->task;
+    }
+    return nullptr;
 }
 
-void TaskQueue::remove(Task *task)
+// Read the arg and the flag before the task may be claimed again
+void TaskQueue::release(Task *task, void **arg, bool *need_clear)
 {
-    _mutex.lock();
-    _tasks.erase(std::find(_tasks.begin(), _tasks.end(), task));
-    _mutex.unlock();
+    if (arg != nullptr) {
+        *arg = task->_link.arg;
+    }
+    if (need_clear != nullptr) {
+        *need_clear = task->_link.need_clear;
+    }
+    task->_link.queued.store(false, std::memory_order_release);
 }
 
-void TaskQueue::clear()
+// Unlink from the middle of the queue, prev is nullptr for the head
+void TaskQueue::unlink(Level &level, TaskLink *prev, TaskLink *link)
 {
-    _tasks.clear();
+    TaskLink *next = link->next.load(std::memory_order_acquire);
+    if (next == nullptr) {
+        if (prev == nullptr) {
+            push(level, &level.stub);
+        } else {
+            // Move the tail back, unless a task is being entered after it
+            prev->next.store(nullptr, std::memory_order_relaxed);
+            TaskLink *expected = link;
+            if (level.tail.compare_exchange_strong(expected, prev, std::memory_order_acq_rel)) {
+                return;
+            }
+            prev->next.store(link, std::memory_order_relaxed);
+        }
+        while ((next = link->next.load(std::memory_order_acquire)) == nullptr) {
+            cpu_relax();
+        }
+    }
+
+    if (prev == nullptr) {
+        level.head = next;
+    } else {
+        prev->next.store(next, std::memory_order_release);
+    }
 }
 
-bool TaskQueue::is_empty() const
+// Definition of class BlockingSection
+BlockingSection::BlockingSection(ThreadPool *pool) : _pool(nullptr)
 {
-    return _tasks.empty();
+    if (pool != nullptr && pool->is_own_worker()) {
+        _pool = pool;
+        ++_pool->_blocked_num;
+        _pool->wake_dispatcher();
+    }
 }
 
-size_t TaskQueue::size() const
+BlockingSection::BlockingSection(BlockingSection &&other) : _pool(other._pool)
 {
-    return _tasks.size();
+    other._pool = nullptr;
+}
+
+BlockingSection::~BlockingSection()
+{
+    if (_pool != nullptr) {
+        --_pool->_blocked_num;
+        _pool = nullptr;
+    }
 }
 
 // Definition of class ThreadPool
@@ -173,22 +302,49 @@ ThreadPool::ThreadPool() : ThreadPool(g_threadpool_init_thread_num)
 }
 
 ThreadPool::ThreadPool(unsigned long long init_threads)
+    : ThreadPool(init_threads, g_threadpool_max_thread_num, g_threadpool_max_task_num)
+{
+    // Nothing to do
+}
+
+ThreadPool::ThreadPool(unsigned long long init_threads, unsigned long long max_threads,
+        unsigned long long max_tasks)
+    : ThreadPool(init_threads, max_threads, max_tasks, StackConfig())
 {
-    if (init_threads > g_threadpool_max_thread_num) {
+    // Nothing to do
+}
+
+ThreadPool::ThreadPool(unsigned long long init_threads, unsigned long long max_threads,
+        unsigned long long max_tasks, const StackConfig &stack)
+    : _max_thread_num(max_threads), _max_task_num(max_tasks), _stack(stack),
+      _unrun_tasks(), _unrun_mutex("ThreadPool::unrun"),
+      _idle_threads(max_threads), _busy_threads(max_threads), _tasks("ThreadPool::tasks"),
+      _local_tasks(max_threads, nullptr), _local_queue_num(0), _local_task_num(0),
+      _affinity_overload(8), _worker_kinds(max_threads, REGULAR), _idle_lane_threads(max_threads),
+      _lane_thread_num(0), _blocked_num(0), _spare_num(0), _max_spare_num(0),
+      _wakeup_seq(0), _wakeup_mutex("ThreadPool::wakeup"), _wakeup_cond(&_wakeup_mutex),
+      _helper_num(0), _help_seq(0), _help_mutex("ThreadPool::help"), _help_cond(&_help_mutex),
+      _blocking(nullptr), _journal(nullptr), _shutdown(false)
+{
+    if (init_threads > _max_thread_num) {
         throw std::runtime_error("The initial threads number is too large!");
     }
 
+    // No thread is started until the first blocking task
+    _blocking = new BlockingExecutor(64, max_tasks, 10000);
+    _blocking->set_stack(stack);
+
     for (unsigned long long i = 0; i < init_threads; ++i) {
         Worker *w = NewWorker();
-        _all_threads.push_back(std::pair<Thread*, bool>(w, true));
-        _idle_threads.push(w);
+        w->set_stack(_stack);
+        attach_worker(w, true);
         w->start();
     }
 }
 
 ThreadPool::~ThreadPool()
 {
-    terminate();
+    shutdown(DISCARD);
     // Clear the whole threads if needed
     for (auto &t : _all_threads) {
         if (t.first != nullptr && t.second) {
@@ -198,110 +354,724 @@ ThreadPool::~ThreadPool()
     }
     _all_threads.clear();
 
-    // Clear the whole tasks if needed
-    std::unordered_map<Task*, std::pair<void*, bool>>::iterator iter;
-    for (iter = _task_args.begin(); iter != _task_args.end(); ++iter) {
-        if (iter->first != nullptr && iter->second.second) {
-            delete iter->first;
-        }
+    // The tasks run are deleted by the workers, the others are kept here
+    for (auto task : _unrun_tasks) {
+        delete task;
     }
-    _task_args.clear();
+    _unrun_tasks.clear();
 
     _idle_threads.clear();
+    _idle_lane_threads.clear();
     _busy_threads.clear();
     _tasks.clear();
+
+    for (auto &queue : _local_tasks) {
+        delete queue;
+        queue = nullptr;
+    }
+
+    delete _blocking;
+    _blocking = nullptr;
 }
 
 bool ThreadPool::add_worker(Thread *worker, bool need_clear)
 {
-    if (_all_threads.size() >= g_threadpool_max_thread_num) {
+    if (_shutdown.load() || _all_threads.size() >= _max_thread_num) {
         return false;
     }
 
-    _all_threads.push_back(std::pair<Thread*, bool>(worker, need_clear));
-    _idle_threads.push(worker);
+    attach_worker(worker, need_clear);
     return true;
 }
 
-bool ThreadPool::add_task(Task *task, void *arg, bool need_clear)
+bool ThreadPool::add_lane(size_t threads, const SchedConfig &sched)
 {
-    if (_tasks.size() >= g_threadpool_max_task_num) {
+    if (_shutdown.load() || _all_threads.size() + threads > _max_thread_num) {
         return false;
     }
 
-    // Thread safe operation
-    _tasks.enter(task);
-    _task_args[task] = std::pair<void *, bool>(arg, need_clear);
+    for (size_t i = 0; i < threads; ++i) {
+        Worker *w = NewWorker();
+        w->set_stack(_stack);
+        w->set_sched(sched);
+        attach_worker(w, true, LANE);
+        w->start();
+    }
+    _lane_thread_num += threads;
     return true;
 }
 
-void ThreadPool::run()
+// The workers get their index, owner and local queue before being idle,
+// only the regular workers take keyed tasks. The other threads are never
+// idle, no task is given to them.
+void ThreadPool::attach_worker(Thread *thread, bool need_clear, WorkerKind kind)
 {
-    while (!_tasks.is_empty()) {
-        while (_idle_threads.is_empty()) {
-            retrieve_busy_to_idle();
+    size_t index = _all_threads.size();
+    Worker *w = dynamic_cast<Worker *>(thread);
+    if (w != nullptr) {
+        w->get_context().set_index(index);
+        w->get_context().set_owner(this);
+        w->set_idle_hook(&ThreadPool::worker_idle, this);
+        if (kind == REGULAR) {
+            w->set_task_source(&ThreadPool::next_local_task, this);
+            _local_tasks[index] = new TaskQueue("ThreadPool::local");
         }
+    }
+    _worker_kinds[index] = kind;
+    _all_threads.push_back(std::pair<Thread*, bool>(thread, need_clear));
+    _local_queue_num.store(_all_threads.size(), std::memory_order_release);
+    if (w != nullptr) {
+        release_to_idle(index);
+    }
+}
+
+void ThreadPool::release_to_idle(size_t index)
+{
+    if (_worker_kinds[index] == LANE) {
+        _idle_lane_threads.set(index);
+    } else {
+        _idle_threads.set(index);
+    }
+}
+
+// Add a spare worker for a blocked one while the tasks are waiting, the
+// slot of a stopped spare is reused first
+bool ThreadPool::compensate()
+{
+    if (_spare_num >= _max_spare_num || _spare_num >= _blocked_num.load()) {
+        return false;
+    }
+
+    size_t index = 0;
+    while (index < _all_threads.size() &&
+            !(_worker_kinds[index] == SPARE && !_all_threads[index].first->is_started())) {
+        ++index;
+    }
+    if (index == _all_threads.size() && index >= _max_thread_num) {
+        return false;
+    }
+
+    Worker *w = NewWorker();
+    w->set_stack(_stack);
+    if (index == _all_threads.size()) {
+        attach_worker(w, true, SPARE);
+    } else {
+        w->get_context().set_index(index);
+        w->get_context().set_owner(this);
+        w->set_idle_hook(&ThreadPool::worker_idle, this);
+        delete _all_threads[index].first;
+        _all_threads[index] = std::pair<Thread*, bool>(w, true);
+        _idle_threads.set(index);
+    }
+    ++_spare_num;
+    return w->start();
+}
 
-        Task *task = _tasks.leave();
-        Worker *worker = dynamic_cast<Worker *>(_idle_threads.pop());
-        if (worker == nullptr) {
+// Stop the idle spare workers beyond the blocked ones
+void ThreadPool::retire_spares()
+{
+    for (size_t i = 0; i < _all_threads.size() && _spare_num > _blocked_num.load(); ++i) {
+        Thread *t = _all_threads[i].first;
+        if (_worker_kinds[i] != SPARE || !t->is_started() || !_idle_threads.claim(i)) {
             continue;
         }
+        t->request_stop();
+        t->join();
+        --_spare_num;
+    }
+}
+
+bool ThreadPool::add_task(Task *task, void *arg, bool need_clear)
+{
+    if (_shutdown.load()) {
+        return false;
+    }
+    if (get_task_num() >= _max_task_num) {
+        TP_PROBE3(task__reject, this, task, _max_task_num);
+        stats_reject(task);
+        return false;
+    }
+
+    return enqueue(task, arg, need_clear);
+}
+
+// Claimed before the task is touched, it may be queued and running already
+bool ThreadPool::enqueue(Task *task, void *arg, bool need_clear)
+{
+    if (!TaskQueue::claim(task)) {
+        return false;
+    }
+
+    trace_event(Tracer::ENQUEUE, task, -1);
+    stats_enqueue(task);
+    _tasks.enter(task, arg, need_clear);
+    notify_helpers();
+    return true;
+}
+
+// Either the helper finds the task just queued, or it is woken up. The
+// fence pairs with the one in help_until().
+void ThreadPool::notify_helpers()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_helper_num.load(std::memory_order_relaxed) > 0) {
+        wake_helpers();
+    }
+}
+
+void ThreadPool::keep_unrun(Task *task, bool need_clear)
+{
+    if (need_clear) {
+        _unrun_mutex.lock();
+        _unrun_tasks.push_back(task);
+        _unrun_mutex.unlock();
+    }
+}
+
+bool ThreadPool::submit_blocking(Task *task, void *arg, bool need_clear)
+{
+    if (_shutdown.load()) {
+        return false;
+    }
+
+    // Freed by the blocking thread once run, or by the executor if never
+    // run, as the task may outlive the pool on a hung thread
+    trace_event(Tracer::ENQUEUE, task, -1);
+    stats_enqueue(task);
+    return _blocking->add_task(task, arg, need_clear);
+}
+
+void ThreadPool::set_blocking_limits(size_t max_threads, size_t max_tasks,
+        unsigned long long keepalive_ms)
+{
+    _blocking->set_limits(max_threads, max_tasks, keepalive_ms);
+}
+
+// Queued with need_clear, so freed along with the inner task once run. The
+// journaled task is marked done.
+class ThreadPool::OwnedTask : public Task {
+public:
+    OwnedTask(Task *task, bool need_clear, TaskJournal *journal, uint64_t offset)
+        : _task(task), _need_clear(need_clear), _journal(journal), _offset(offset)
+    {
+        set_tname(task->get_tname());
+        set_priority(task->get_priority());
+    }
+
+    ~OwnedTask()
+    {
+        if (_need_clear) {
+            delete _task;
+            _task = nullptr;
+        }
+    }
+
+    int run(void *) override
+    {
+        _task->set_executor(get_executor());
+        int ret = _task->run(nullptr);
+        _journal->complete(_offset);
+        return ret;
+    }
+
+    void release() { _task = nullptr; }
+
+private:
+    Task *        _task;
+    bool          _need_clear;
+    TaskJournal * _journal;
+    uint64_t      _offset;
+};
 
-        task->set_executor(worker);
-        worker->set_task(task, _task_args[task].first);
-        _busy_threads.enter(worker);
+size_t ThreadPool::set_journal(TaskJournal *journal)
+{
+    if (_shutdown.load()) {
+        return 0;
+    }
+    _journal = journal;
 
-        worker->resume();
+    // Accepted by the last run, so queued beyond the max tasks rather than
+    // left pending in the journal
+    std::vector<TaskJournal::Entry> entries = journal->replay();
+    for (auto &entry : entries) {
+        enqueue(new OwnedTask(entry.task, true, journal, entry.offset), nullptr, true);
     }
+    return entries.size();
 }
 
-void ThreadPool::stop()
+bool ThreadPool::add_journaled_task(SerializableTask *task, bool need_clear)
 {
-    while (!_busy_threads.is_empty()) {
-        Thread *t = _busy_threads.leave();
-        if (t->get_thread_state() == Thread::State::RUNNING) {
-            t->join();
+    uint64_t offset = 0;
+    if (_journal == nullptr || _shutdown.load() || !_journal->append(task, &offset)) {
+        return false;
+    }
+
+    OwnedTask *wrapper = new OwnedTask(task, need_clear, _journal, offset);
+    if (add_task(wrapper, nullptr, true)) {
+        return true;
+    }
+
+    // The task is still owned by the caller
+    _journal->complete(offset);
+    wrapper->release();
+    delete wrapper;
+    return false;
+}
+
+size_t ThreadPool::add_shared_tasks(SharedTaskQueue *queue, unsigned long long timeout_ms)
+{
+    // Left in the shared queue for the other consumers if there is no room
+    size_t added = 0;
+    while (!_shutdown.load() && get_task_num() < _max_task_num) {
+        SerializableTask *task = queue->pop(added == 0 ? timeout_ms : 0);
+        if (task == nullptr) {
+            break;
+        }
+        if (!add_task(task, nullptr, true)) {
+            delete task;
+            break;
         }
-        _idle_threads.push(t);
+        ++added;
     }
+    return added;
 }
 
-void ThreadPool::terminate()
+bool ThreadPool::add_keyed_task(Task *task, void *arg, unsigned long long key, bool need_clear)
 {
-    // Wait for the busy threads to be idle
-    // Remove from the busy list and add to the idle list
-    while (!_busy_threads.is_empty()) {
-        for (auto &thread : _all_threads) {
-            if (_busy_threads.exist(thread.first)) {
-                if (thread.first->get_thread_state() == Thread::State::SUSPENDED) {
-                    _busy_threads.remove(thread.first);
-                    _idle_threads.push(thread.first);
+    size_t index = 0;
+    TaskQueue *queue = get_local_queue(key, &index);
+    if (queue == nullptr) {
+        return add_task(task, arg, need_clear);
+    }
+    if (_shutdown.load()) {
+        return false;
+    }
+    if (get_task_num() >= _max_task_num) {
+        TP_PROBE3(task__reject, this, task, _max_task_num);
+        stats_reject(task);
+        return false;
+    }
+
+    if (!TaskQueue::claim(task)) {
+        return false;
+    }
+
+    trace_event(Tracer::ENQUEUE, task, -1);
+    stats_enqueue(task);
+    ++_local_task_num;
+    queue->enter(task, arg, need_clear);
+    notify_helpers();
+
+    // An idle owner is only resumed by the dispatcher, which may be waiting
+    // for a busy worker
+    if (_idle_threads.test(index)) {
+        wake_dispatcher();
+    }
+    return true;
+}
+
+// Jump consistent hash, only 1/n of the keys move when the n-th worker is added
+TaskQueue *ThreadPool::get_local_queue(unsigned long long key, size_t *index)
+{
+    size_t num = _local_queue_num.load(std::memory_order_acquire);
+    if (num == 0) {
+        return nullptr;
+    }
+
+    long long bucket = -1;
+    long long next = 0;
+    while (next < static_cast<long long>(num)) {
+        bucket = next;
+        key = key * 2862933555777941757ULL + 1;
+        next = static_cast<long long>((bucket + 1) *
+                (static_cast<double>(1LL << 31) / static_cast<double>((key >> 33) + 1)));
+    }
+
+    // Skip the threads which are not Worker
+    for (size_t i = 0; i < num; ++i) {
+        *index = (bucket + i) % num;
+        if (_local_tasks[*index] != nullptr) {
+            return _local_tasks[*index];
+        }
+    }
+    return nullptr;
+}
+
+// Called by the worker itself once its current task finished. A worker
+// left hung by shutdown() is told to stop before being detached, and must
+// not touch the pool which may be gone by then.
+Task *ThreadPool::next_local_task(void *owner, Worker *worker, void **arg, bool *need_clear)
+{
+    if (worker->is_stop_requested()) {
+        return nullptr;
+    }
+    ThreadPool *pool = static_cast<ThreadPool *>(owner);
+    size_t index = worker->get_context().get_index();
+    Task *task = pool->_local_tasks[index]->leave(arg, need_clear);
+    if (task == nullptr) {
+        return nullptr;
+    }
+
+    --pool->_local_task_num;
+    trace_event(Tracer::DISPATCH, task, static_cast<long>(index));
+    TP_PROBE2(task__dispatch, task, index);
+    return task;
+}
+
+bool ThreadPool::remove_task(Task *task)
+{
+    bool need_clear = false;
+    if (!_tasks.remove(task, &need_clear)) {
+        bool found = false;
+        for (size_t i = 0; !found && i < _local_queue_num.load(); ++i) {
+            found = (_local_tasks[i] != nullptr && _local_tasks[i]->remove(task, &need_clear));
+        }
+        if (!found) {
+            return false;
+        }
+        --_local_task_num;
+
+        // The dispatcher may be waiting for the owner to run it
+        wake_dispatcher();
+    }
+
+    keep_unrun(task, need_clear);
+    return true;
+}
+
+Task *ThreadPool::take_task(void **arg, bool *need_clear)
+{
+    return _tasks.leave(arg, need_clear);
+}
+
+// The arena is left alone, it may still be used by the waiting task
+int ThreadPool::run_inline(Task *task, void *arg)
+{
+    Worker *worker = is_own_worker() ? Worker::current() : nullptr;
+    long index = (worker != nullptr) ? static_cast<long>(worker->get_context().get_index()) : -1;
+
+    task->set_executor(worker);
+    trace_event(Tracer::START, task, index);
+    TP_PROBE2(task__start, task, index);
+    TaskStats::Sample sample;
+    bool measured = stats_begin(task, &sample);
+    int ret = task->run(arg);
+    if (measured) {
+        TaskStats::end(sample);
+    }
+    trace_finish(index);
+    TP_PROBE3(task__finish, task, index, ret);
+    return ret;
+}
+
+bool ThreadPool::run_queued_task()
+{
+    void *arg = nullptr;
+    bool need_clear = false;
+    Task *task = nullptr;
+    Worker *worker = is_own_worker() ? Worker::current() : nullptr;
+    TaskQueue *local = nullptr;
+    if (worker != nullptr) {
+        local = _local_tasks[worker->get_context().get_index()];
+    }
+    if (local != nullptr && (task = local->leave(&arg, &need_clear)) != nullptr) {
+        --_local_task_num;
+    } else if ((task = take_task(&arg, &need_clear)) == nullptr) {
+        return false;
+    }
+
+    run_inline(task, arg);
+    if (need_clear) {
+        delete task;
+    }
+    return true;
+}
+
+void ThreadPool::help_until(HelpDone done, void *owner)
+{
+    ++_helper_num;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    while (!done(owner)) {
+        size_t seen = _help_seq.load();
+        if (run_queued_task()) {
+            continue;
+        }
+
+        // Nothing to help, sleep until a task is queued or the owner is done
+        _help_mutex.lock();
+        while (_help_seq.load() == seen && !done(owner)) {
+            _help_cond.wait();
+        }
+        _help_mutex.unlock();
+    }
+    --_helper_num;
+}
+
+void ThreadPool::wake_helpers()
+{
+    _help_mutex.lock();
+    ++_help_seq;
+    _help_cond.broadcast();
+    _help_mutex.unlock();
+}
+
+std::vector<size_t> ThreadPool::get_stack_resident() const
+{
+    std::vector<size_t> sizes;
+    for (const auto &thread : _all_threads) {
+        sizes.push_back(thread.first->get_stack_resident());
+    }
+    return sizes;
+}
+
+bool ThreadPool::is_own_worker() const
+{
+    WorkerContext *context = WorkerContext::current();
+    return (context != nullptr && context->get_owner() == this);
+}
+
+void ThreadPool::run()
+{
+    TP_PROBE2(pool__run__begin, this, get_task_num());
+    dispatch(nullptr);
+    TP_PROBE1(pool__run__end, this);
+}
+
+// Dispatch the queued tasks to the idle workers until the queue is empty,
+// return false if the deadline is reached before
+bool ThreadPool::dispatch(const struct timespec *deadline)
+{
+    while (!_tasks.is_empty() || _local_task_num.load() > 0) {
+        // Any worker going idle from now on wakes up the waits below
+        size_t seen = _wakeup_seq.load();
+        if (_local_task_num.load() > 0) {
+            dispatch_local_tasks();
+            if (_tasks.is_empty()) {
+                // The busy workers run their own queued tasks by themselves
+                if (!wait_for_wakeup(seen, deadline)) {
+                    return false;
                 }
+                continue;
+            }
+        }
+
+        if (_lane_thread_num > 0) {
+            dispatch_lane_tasks();
+            if (_tasks.is_empty()) {
+                continue;
+            }
+        }
+
+        if (_idle_threads.is_empty()) {
+            if (_blocked_num.load() > 0) {
+                compensate();
+            }
+            if (_idle_threads.is_empty() && !wait_for_wakeup(seen, deadline)) {
+                return false;
             }
+            continue;
+        }
+
+        // The worker is claimed first, a task once left cannot be put back
+        // at its place. The queue may be drained by remove_task() meanwhile.
+        size_t index = 0;
+        if (!_idle_threads.claim_any(&index)) {
+            continue;
         }
+        void *arg = nullptr;
+        bool need_clear = false;
+        Task *task = _tasks.leave(&arg, &need_clear);
+        if (task == nullptr) {
+            _idle_threads.set(index);
+            continue;
+        }
+        assign(static_cast<Worker *>(_all_threads[index].first), task, arg, need_clear);
     }
-    // Wait for all idle threads to finish
-    while (!_idle_threads.is_empty()) {
-        Thread *w = _idle_threads.pop();
-        w->cancel();
-        w->join();
+
+    if (_spare_num > 0 && !_shutdown.load()) {
+        retire_spares();
     }
+    return true;
 }
 
-// Retrive the busy thread to idle when there is no idle threads
-void ThreadPool::retrieve_busy_to_idle()
+// Wake up the idle workers having their own queued tasks, and let the other
+// idle ones steal from the overloaded workers
+void ThreadPool::dispatch_local_tasks()
 {
-    while (_idle_threads.is_empty()) {
-        for (auto &thread : _all_threads) {
-            if (_busy_threads.exist(thread.first)) {
-                if (thread.first->get_thread_state() == Thread::State::SUSPENDED) {
-                    _busy_threads.remove(thread.first);
-                    _idle_threads.push(thread.first);
-                }
+    size_t num = _local_queue_num.load(std::memory_order_acquire);
+    for (size_t i = 0; i < num; ++i) {
+        TaskQueue *queue = _local_tasks[i];
+        if (queue == nullptr || queue->is_empty()) {
+            continue;
+        }
+
+        void *arg = nullptr;
+        bool need_clear = false;
+        if (_idle_threads.claim(i)) {
+            Task *task = queue->leave(&arg, &need_clear);
+            if (task == nullptr) {
+                _idle_threads.set(i);
+                continue;
             }
+            --_local_task_num;
+            assign(static_cast<Worker *>(_all_threads[i].first), task, arg, need_clear);
+        }
+
+        size_t index = 0;
+        while (queue->size() > _affinity_overload && _idle_threads.claim_any(&index)) {
+            Worker *thief = static_cast<Worker *>(_all_threads[index].first);
+            Task *task = queue->leave(&arg, &need_clear);
+            if (task == nullptr) {
+                _idle_threads.set(index);
+                break;
+            }
+            --_local_task_num;
+            assign(thief, task, arg, need_clear);
+        }
+    }
+}
+
+// The HIGH tasks are at the front of the queue, given to the lane first
+void ThreadPool::dispatch_lane_tasks()
+{
+    size_t index = 0;
+    while (_idle_lane_threads.claim_any(&index)) {
+        void *arg = nullptr;
+        bool need_clear = false;
+        Task *task = _tasks.leave_if(Task::HIGH, &arg, &need_clear);
+        if (task == nullptr) {
+            _idle_lane_threads.set(index);
+            return;
+        }
+        assign(static_cast<Worker *>(_all_threads[index].first), task, arg, need_clear);
+    }
+}
+
+void ThreadPool::wake_dispatcher()
+{
+    _wakeup_mutex.lock();
+    ++_wakeup_seq;
+    _wakeup_cond.broadcast();
+    _wakeup_mutex.unlock();
+}
+
+// Return false if the deadline is reached before any wakeup since seen
+bool ThreadPool::wait_for_wakeup(size_t seen, const struct timespec *deadline)
+{
+    _wakeup_mutex.lock();
+    while (_wakeup_seq.load() == seen) {
+        if (deadline == nullptr) {
+            _wakeup_cond.wait();
+        } else if (!_wakeup_cond.wait(*deadline)) {
+            break;
+        }
+    }
+    bool woken = (_wakeup_seq.load() != seen);
+    _wakeup_mutex.unlock();
+    return woken;
+}
+
+// Called by the worker itself once it is suspended, same as next_local_task().
+// It is only resumed by assign() after this, so the dispatcher never has
+// to look for the finished workers.
+void ThreadPool::worker_idle(void *owner, Worker *worker)
+{
+    if (worker->is_stop_requested()) {
+        return;
+    }
+    ThreadPool *pool = static_cast<ThreadPool *>(owner);
+    size_t index = worker->get_context().get_index();
+    if (pool->_busy_threads.claim(index)) {
+        pool->release_to_idle(index);
+    }
+    pool->wake_dispatcher();
+}
+
+void ThreadPool::assign(Worker *worker, Task *task, void *arg, bool need_clear)
+{
+    task->set_executor(worker);
+    worker->set_task(task, arg, need_clear);
+    _busy_threads.set(worker->get_context().get_index());
+    trace_event(Tracer::DISPATCH, task, static_cast<long>(worker->get_context().get_index()));
+    TP_PROBE2(task__dispatch, task, worker->get_context().get_index());
+
+    worker->resume();
+}
+
+void ThreadPool::stop()
+{
+    size_t index = 0;
+    while (_busy_threads.claim_any(&index)) {
+        Thread *t = _all_threads[index].first;
+        if (t->get_thread_state() == Thread::State::RUNNING) {
+            t->join();
+        }
+        release_to_idle(index);
+    }
+}
+
+ThreadPool::ShutdownReport ThreadPool::shutdown(ShutdownMode mode,
+        unsigned long long timeout_ms)
+{
+    ShutdownReport report;
+    report.joined_threads = 0;
+    report.hung_threads   = 0;
+    if (_shutdown.exchange(true)) {
+        return report;
+    }
+
+    struct timespec deadline = make_deadline(timeout_ms);
+    const struct timespec *limit = (timeout_ms > 0) ? &deadline : nullptr;
+    if (mode == DRAIN) {
+        dispatch(limit);
+    }
+
+    // Whatever left in the queues will never be run
+    Task *task = nullptr;
+    bool need_clear = false;
+    while ((task = _tasks.leave(nullptr, &need_clear)) != nullptr) {
+        report.unrun_tasks.push_back(task);
+        keep_unrun(task, need_clear);
+    }
+    for (size_t i = 0; i < _local_queue_num.load(); ++i) {
+        while (_local_tasks[i] != nullptr &&
+                (task = _local_tasks[i]->leave(nullptr, &need_clear)) != nullptr) {
+            --_local_task_num;
+            report.unrun_tasks.push_back(task);
+            keep_unrun(task, need_clear);
+        }
+    }
+
+    // Stop both the workers and the blocking threads at once, the busy ones
+    // exit after their tasks
+    _blocking->request_shutdown(mode == DRAIN, &report.unrun_tasks);
+    for (auto &thread : _all_threads) {
+        thread.first->request_stop();
+    }
+
+    // The threads are winding down in parallel, join them against one deadline
+    report.hung_threads += _blocking->join_threads(limit, &report.unrun_tasks);
+    for (auto &thread : _all_threads) {
+        Thread *t = thread.first;
+        if (!t->is_started() || t->is_daemon()) {
+            continue;
+        }
+        if (limit ? t->join(deadline) : t->join()) {
+            ++report.joined_threads;
+            continue;
         }
+
+        // Leave the hung thread alone, its object must be kept alive. Its
+        // task is deleted by itself once run if need_clear.
+        t->detach();
+        thread.second = false;
+        ++report.hung_threads;
     }
+
+    _idle_threads.clear();
+    _idle_lane_threads.clear();
+    _busy_threads.clear();
+    return report;
 }
 
 END_NAMESPACE
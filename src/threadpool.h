@@ -9,10 +9,11 @@
 #ifndef THREADPOOL_THREADPOOL_H
 #define THREADPOOL_THREADPOOL_H
 
+#include <stdint.h>
+
 #include <vector>
-#include <list>
-#include <stack>
-#include <unordered_map>
+#include <atomic>
+#include <memory>
 
 #include "common.h"
 #include "util.h"
@@ -21,94 +22,321 @@
 
 BEGIN_NAMESPACE
 
-class IdleThreadsStack {
+/**
+ * Set of worker indexes in atomic 64-bit words. Setting or claiming the
+ * given index is a single atomic operation, no lock is taken.
+ */
+class WorkerBitmap {
 public:
-    IdleThreadsStack() = default;
-    ~IdleThreadsStack() = default;
+    explicit WorkerBitmap(size_t capacity);
+    ~WorkerBitmap() = default;
 
-    void push(Thread*);
-    Thread* pop();
-    Thread* top() const;
-    void clear();
+    // No copying
+    WorkerBitmap(const WorkerBitmap &) = delete;
+    WorkerBitmap &operator=(const WorkerBitmap &) = delete;
 
-    bool is_empty() const;
-    size_t size() const;
+    // Return false if already set
+    bool set(size_t index);
 
-private:
-    std::stack<Thread*> _threads;
-    Mutex               _mutex;
-};
+    // Claim the index, return false if not set
+    bool claim(size_t index);
 
-class BusyThreadsList {
-public:
-    BusyThreadsList() = default;
-    ~BusyThreadsList() = default;
-
-    void enter(Thread*);
-    Thread* leave();
-    Thread* front() const;
-    bool exist(Thread*) const;
-    void remove(Thread*);
+    // Claim the lowest index set, return false if none
+    bool claim_any(size_t *index);
+
+    bool test(size_t index) const;
     void clear();
 
-    bool is_empty() const;
-    size_t size() const;
+    bool is_empty() const { return _count.load() == 0; }
+    size_t size() const { return _count.load(); }
+    size_t capacity() const { return _words * 64; }
 
 private:
-    std::list<Thread*> _threads;
-    Mutex              _mutex;
+    std::unique_ptr<std::atomic<uint64_t>[]> _bits;
+    size_t                                   _words;
+    std::atomic<size_t>                      _count;
 };
 
+/**
+ * Unbounded task queue linked through the tasks themselves, so nothing is
+ * allocated. Entering is wait-free (Vyukov's MPSC queue) while leaving
+ * takes a lock shared by the consumers only. One sub-queue per priority,
+ * FIFO in each. A task is in one queue at most, it is claimed before
+ * entering and released when it leaves or is removed.
+ */
 class TaskQueue {
 public:
-    TaskQueue() = default;
+    // Profiled under the name, e.g. "ThreadPool::tasks". All tasks leave
+    // in the order entered if fifo, whatever the priority.
+    explicit TaskQueue(const char *name="TaskQueue", bool fifo=false);
     ~TaskQueue() = default;
 
-    void enter(Task*);
-    Task* leave();
-    Task* front() const;
+    // No copying
+    TaskQueue(const TaskQueue &) = delete;
+    TaskQueue &operator=(const TaskQueue &) = delete;
+
+    // Return false if the task is in a queue already, e.g. added twice
+    static bool claim(Task*);
+
+    // The task must be claimed first, the arg and the flag leave with it
+    void enter(Task*, void *arg=nullptr, bool need_clear=false);
+    Task* leave(void **arg=nullptr, bool *need_clear=nullptr);
+
+    // Leave only if the first task is of the priority or higher
+    Task* leave_if(Task::Priority, void **arg=nullptr, bool *need_clear=nullptr);
     bool exist(Task*) const;
-    void remove(Task*);
+    bool remove(Task*, bool *need_clear=nullptr);
     void clear();
 
     bool is_empty() const;
     size_t size() const;
 
 private:
-    std::list<Task*> _tasks;
-    Mutex            _mutex;
+    struct Level {
+        Level() : tail(&stub), head(&stub), stub() {}
+
+        std::atomic<TaskLink*> tail;  // Entered last
+        TaskLink *             head;  // To leave next, only touched with the lock
+        TaskLink               stub;
+    };
+
+    static void push(Level &, TaskLink *);
+    static Task *pop(Level &);
+    static void release(Task *, void **arg, bool *need_clear);
+    static void unlink(Level &, TaskLink *prev, TaskLink *link);
+
+    Level               _levels[Task::HIGH + 1];
+    mutable Mutex       _mutex;
+    bool                _fifo;
+
+    // Read without the lock by the dispatcher and the workers
+    std::atomic<size_t> _size;
+};
+
+class ThreadPool;
+class BlockingExecutor;
+
+// Tell a worker helping the pool that what it waits for is done
+typedef bool (*HelpDone)(void *owner);
+class TaskJournal;
+class SerializableTask;
+class SharedTaskQueue;
+
+/**
+ * Marks the calling task as blocked, e.g. on a disk read, so that the pool
+ * may run a spare worker meanwhile. Nothing is done if the caller is not a
+ * worker of the pool.
+ */
+class BlockingSection {
+public:
+    explicit BlockingSection(ThreadPool *pool);
+    BlockingSection(BlockingSection &&other);
+    ~BlockingSection();
+
+    // No copying
+    BlockingSection(const BlockingSection &) = delete;
+    BlockingSection &operator=(const BlockingSection &) = delete;
+
+private:
+    ThreadPool *_pool;
 };
 
 class ThreadPool {
 public:
+    enum ShutdownMode {
+        DRAIN,   // Dispatch the queued tasks before stopping
+        DISCARD  // Stop right after the running tasks finished
+    };
+
+    struct ShutdownReport {
+        size_t             joined_threads;
+        size_t             hung_threads;  // Still running at the deadline, detached
+        std::vector<Task*> unrun_tasks;   // Still owned by the pool if need_clear
+    };
+
     ThreadPool();
     explicit ThreadPool(unsigned long long threads);
+
+    // Limits of this pool only, the g_threadpool_* globals are the defaults
+    ThreadPool(unsigned long long threads, unsigned long long max_threads,
+               unsigned long long max_tasks);
+
+    // Stack of the workers created by the pool, e.g. StackConfig(256 * 1024)
+    ThreadPool(unsigned long long threads, unsigned long long max_threads,
+               unsigned long long max_tasks, const StackConfig &stack);
     ~ThreadPool();
 
     bool add_worker(Thread * worker, bool need_clear=false);
+
+    // Return false if full, or the task is queued already. The task is
+    // deleted once run if need_clear.
     bool add_task(Task *, void *arg=nullptr, bool need_clear=false);
+
+    // The tasks of the same key are queued for the same worker by consistent
+    // hashing, and only taken by the idle workers if that one is overloaded
+    bool add_keyed_task(Task *, void *arg, unsigned long long key, bool need_clear=false);
+
+    // Queued tasks over which a worker is overloaded, 8 by default
+    void set_affinity_overload(size_t num) { _affinity_overload = num; }
+
+    // Extra workers under the scheduling for the HIGH tasks, which are still
+    // run by the other workers if the lane is busy
+    bool add_lane(size_t threads, const SchedConfig &sched);
+    size_t get_lane_thread_num() const { return _lane_thread_num; }
+
+    // Spare workers added while the workers are in a blocking section and
+    // tasks are waiting, stopped once not needed. 0 by default, disabled.
+    void set_max_spare(size_t num) { _max_spare_num = num; }
+    BlockingSection blocking_section() { return BlockingSection(this); }
+    size_t get_blocked_num() const { return _blocked_num.load(); }
+    size_t get_spare_num() const { return _spare_num; }
+
+    // Run on the threads of a separate elastic executor with its own queue,
+    // so the workers never wait behind file or syscall-heavy tasks
+    bool submit_blocking(Task *, void *arg=nullptr, bool need_clear=false);
+
+    // 64 threads, the max_tasks of the pool and 10s keepalive by default
+    void set_blocking_limits(size_t max_threads, size_t max_tasks,
+                             unsigned long long keepalive_ms=10000);
+    BlockingExecutor &get_blocking_executor() { return *_blocking; }
+
+    // Queue the unfinished tasks of the journal left by the last run, before
+    // any other task is added and even beyond the max tasks. Return the
+    // number of the tasks queued.
+    size_t set_journal(TaskJournal *journal);
+
+    // Written to the journal first, marked done once finished
+    bool add_journaled_task(SerializableTask *, bool need_clear=false);
+
+    // Move the tasks pushed by other processes into the pool while it has room,
+    // waiting up to timeout_ms for the first one. Return the number moved.
+    size_t add_shared_tasks(SharedTaskQueue *queue, unsigned long long timeout_ms);
+
+    // Take back a queued task which has not been dispatched yet, the pool
+    // still owns it if need_clear and deletes it with the pool
+    bool remove_task(Task *);
+
+    // Pop the first queued task to be run by the caller instead of a worker,
+    // the caller owns it if need_clear
+    Task *take_task(void **arg, bool *need_clear);
+
+    // Run a task taken from the pool on the calling thread with the same
+    // executor, trace, stats and probes as on a worker
+    int run_inline(Task *, void *arg);
+
+    // Take and run inline one queued task, the caller's own keyed tasks
+    // first if it is a worker of the pool. Return false if there is none.
+    bool run_queued_task();
+
+    // Run the queued tasks inline until done(owner), sleeping while there
+    // is none until a task is queued or wake_helpers() is called
+    void help_until(HelpDone done, void *owner);
+    void wake_helpers();
+
+    // Test if the caller is running on a worker of this pool
+    bool is_own_worker() const;
+
     void run();
     void stop();
 
+    // Stop all workers with one stop signal each and join them before the
+    // deadline, 0 timeout means waiting forever. Only the first call works.
+    ShutdownReport shutdown(ShutdownMode mode=DRAIN, unsigned long long timeout_ms=0);
+    bool is_shutdown() const { return _shutdown.load(); }
+
     size_t get_thread_num() const { return _all_threads.size(); }
     size_t get_idle_thread_num() const { return _idle_threads.size(); }
     size_t get_busy_thread_num() const { return _busy_threads.size(); }
-    size_t get_task_num() const { return _tasks.size(); }
+    size_t get_task_num() const { return _tasks.size() + _local_task_num.load(); }
+
+    size_t get_max_thread_num() const { return _max_thread_num; }
+    size_t get_max_task_num() const { return _max_task_num; }
+
+    // Resident stack bytes of each thread, in the order of being added
+    std::vector<size_t> get_stack_resident() const;
 
 protected:
-    void terminate();
-    void retrieve_busy_to_idle();
+    class OwnedTask;
+
+    // Queue without checking the limits, false if queued already
+    bool enqueue(Task *, void *arg, bool need_clear);
+    void notify_helpers();
+    void keep_unrun(Task *, bool need_clear);
+
+    bool dispatch(const struct timespec *deadline);
+    void dispatch_local_tasks();
+    void dispatch_lane_tasks();
+    void assign(Worker *, Task *, void *arg, bool need_clear);
+
+    enum WorkerKind {
+        REGULAR,
+        LANE,   // Run the HIGH tasks only
+        SPARE   // Added for the blocked workers
+    };
+
+    // The dispatcher waits for a worker to go idle or be blocked, instead
+    // of polling the busy ones
+    void wake_dispatcher();
+    bool wait_for_wakeup(size_t seen, const struct timespec *deadline);
+    static void worker_idle(void *owner, Worker *worker);
+
+    void attach_worker(Thread *, bool need_clear, WorkerKind kind=REGULAR);
+    void release_to_idle(size_t index);
+    bool compensate();
+    void retire_spares();
+    TaskQueue *get_local_queue(unsigned long long key, size_t *index);
+    static Task *next_local_task(void *pool, Worker *worker, void **arg, bool *need_clear);
 
 private:
+    unsigned long long _max_thread_num;
+    unsigned long long _max_task_num;
+    StackConfig        _stack;
+
     // Whole threads: pointer to a thread => clear needed
     std::vector<std::pair<Thread*, bool>>             _all_threads;
 
-    // Task and its args and clear needed flag
-    std::unordered_map<Task*, std::pair<void*, bool>> _task_args;
+    // Taken off the queues unrun while need_clear, deleted with the pool
+    std::vector<Task*>   _unrun_tasks;
+    Mutex                _unrun_mutex;
 
-    IdleThreadsStack     _idle_threads;
-    BusyThreadsList      _busy_threads;
+    // Indexes of _all_threads
+    WorkerBitmap         _idle_threads;
+    WorkerBitmap         _busy_threads;
     TaskQueue            _tasks;
+
+    // Keyed tasks queued for each worker, aligned with _all_threads and
+    // nullptr for the threads which are not Worker
+    std::vector<TaskQueue*> _local_tasks;
+    std::atomic<size_t>     _local_queue_num;
+    std::atomic<size_t>     _local_task_num;
+    std::atomic<size_t>     _affinity_overload;
+
+    // WorkerKind by the index of _all_threads
+    std::vector<char>       _worker_kinds;
+    WorkerBitmap            _idle_lane_threads;
+    size_t                  _lane_thread_num;
+
+    std::atomic<size_t>     _blocked_num;
+    size_t                  _spare_num;
+    size_t                  _max_spare_num;
+
+    // Bumped under the mutex at each wakeup of the dispatcher
+    std::atomic<size_t>     _wakeup_seq;
+    Mutex                   _wakeup_mutex;
+    Condition               _wakeup_cond;
+
+    // Same for the helpers, only woken up at enqueue if there is one
+    std::atomic<size_t>     _helper_num;
+    std::atomic<size_t>     _help_seq;
+    Mutex                   _help_mutex;
+    Condition               _help_cond;
+
+    BlockingExecutor *      _blocking;
+    TaskJournal *           _journal;
+
+    friend class BlockingSection;
+
+    std::atomic<bool>    _shutdown;
 };
 
 END_NAMESPACE
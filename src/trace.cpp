@@ -0,0 +1,250 @@
+/**
+ * A thread pool framework
+ * Copyright 2017 (c), Oshyn Song (dualyangsong@gmail.com)
+ *
+ * @file    trace.cpp
+ * @author  Oshyn Song
+ * @time    2017.8
+ */
+#include "trace.h"
+#include "util.h"
+
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <fstream>
+#include <vector>
+
+BEGIN_NAMESPACE
+
+std::atomic<bool>     Tracer::s_enabled(false);
+std::atomic<size_t>   Tracer::s_capacity(64 * 1024);
+std::atomic<unsigned> Tracer::s_epoch(0);
+
+namespace {
+
+struct TraceEvent {
+    unsigned long long ts_ns;
+    task_id_t          tid;
+    const char *       name;
+    int                priority;
+    int                type;
+    long               worker;
+};
+
+// Written by its own thread only, read by the dumping thread
+struct TraceRing {
+    // Tasks run inline by a waiting task, e.g. in TaskGroup::wait(), nest
+    static const size_t MAX_NESTING = 16;
+
+    TraceRing(size_t capacity, unsigned epoch)
+        : events(capacity), head(0), os_tid(syscall(SYS_gettid)), worker(-1),
+          running(), depth(0), epoch(epoch)
+    {
+        // Nothing to do
+    }
+
+    std::vector<TraceEvent>         events;
+    std::atomic<unsigned long long> head;
+    long                            os_tid;
+    std::atomic<long>               worker;
+    TraceEvent                      running[MAX_NESTING];  // Started, not finished
+    size_t                          depth;  // May be beyond MAX_NESTING
+    unsigned                        epoch;  // Of the enable() the ring is recording for
+};
+
+// Rings outlive their threads so that the events can still be dumped, and
+// are never freed since detached workers may still be recording at exit.
+// The lock is also held while dumping, as the events may be reallocated.
+Mutex                    s_rings_mutex;
+std::vector<TraceRing*> *s_rings = new std::vector<TraceRing*>();
+thread_local TraceRing * s_ring = nullptr;
+
+unsigned long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<unsigned long long>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+TraceRing *get_ring(size_t capacity, unsigned epoch)
+{
+    if (s_ring == nullptr) {
+        s_ring = new TraceRing(capacity, epoch);
+        s_rings_mutex.lock();
+        s_rings->push_back(s_ring);
+        s_rings_mutex.unlock();
+    } else if (s_ring->epoch != epoch) {
+        // Enabled again, the tasks started before may have finished unseen
+        s_ring->depth = 0;
+        s_ring->epoch = epoch;
+        if (s_ring->events.size() != capacity) {
+            s_rings_mutex.lock();
+            s_ring->events.assign(capacity, TraceEvent());
+            s_ring->head.store(0, std::memory_order_relaxed);
+            s_rings_mutex.unlock();
+        }
+    }
+    return s_ring;
+}
+
+void write_string(std::ostream &os, const char *str)
+{
+    os << '"';
+    for (const char *p = str; *p != '\0'; ++p) {
+        unsigned char c = static_cast<unsigned char>(*p);
+        if (c == '"' || c == '\\') {
+            os << '\\' << *p;
+        } else if (c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            os << buf;
+        } else {
+            os << *p;
+        }
+    }
+    os << '"';
+}
+
+void write_event(std::ostream &os, long pid, const TraceRing &ring, const TraceEvent &ev)
+{
+    static const char *s_instant_names[] = {"enqueue", "dispatch"};
+    const char *name = (ev.name != nullptr) ? ev.name : "task";
+
+    os << "{\"pid\":" << pid << ",\"tid\":" << ring.os_tid
+       << ",\"ts\":" << (ev.ts_ns / 1000) << '.' << (ev.ts_ns % 1000) / 100
+       << ",\"cat\":\"task\",";
+    switch (ev.type) {
+        case Tracer::START:
+            os << "\"ph\":\"B\",\"name\":";
+            write_string(os, name);
+            break;
+        case Tracer::FINISH:
+            os << "\"ph\":\"E\",\"name\":";
+            write_string(os, name);
+            break;
+        default:
+            os << "\"ph\":\"i\",\"s\":\"t\",\"name\":\"" << s_instant_names[ev.type] << '"';
+            break;
+    }
+    os << ",\"args\":{\"task\":" << ev.tid << ",\"tname\":";
+    write_string(os, name);
+    os << ",\"priority\":" << ev.priority << ",\"worker\":" << ev.worker << "}}";
+}
+
+void push_event(TraceRing *ring, const TraceEvent &event)
+{
+    unsigned long long pos = ring->head.load(std::memory_order_relaxed);
+    TraceEvent &ev = ring->events[pos % ring->events.size()];
+    ev = event;
+    ev.ts_ns = now_ns();
+    ring->head.store(pos + 1, std::memory_order_release);
+}
+
+} // namespace
+
+void Tracer::enable(size_t capacity)
+{
+    s_capacity = (capacity > 0) ? capacity : 1;
+    ++s_epoch;
+    s_enabled  = true;
+}
+
+void Tracer::disable()
+{
+    s_enabled = false;
+}
+
+void Tracer::record(EventType type, const Task *task, long worker)
+{
+    TraceRing *ring = get_ring(s_capacity.load(std::memory_order_relaxed),
+                               s_epoch.load(std::memory_order_relaxed));
+    TraceEvent ev;
+    ev.ts_ns    = 0;
+    ev.tid      = task->get_tid();
+    ev.name     = task->get_tname();
+    ev.priority = static_cast<int>(task->get_priority());
+    ev.type     = static_cast<int>(type);
+    ev.worker   = worker;
+    if (type == START) {
+        // Dropped with its finish if too deeply nested
+        if (ring->depth++ >= TraceRing::MAX_NESTING) {
+            return;
+        }
+        ring->running[ring->depth - 1] = ev;
+        if (worker >= 0) {
+            ring->worker.store(worker, std::memory_order_relaxed);
+        }
+    }
+    push_event(ring, ev);
+}
+
+void Tracer::record_finish(long worker)
+{
+    // Nothing started since tracing was enabled, or too deeply nested
+    TraceRing *ring = get_ring(s_capacity.load(std::memory_order_relaxed),
+                               s_epoch.load(std::memory_order_relaxed));
+    if (ring->depth == 0 || ring->depth-- > TraceRing::MAX_NESTING) {
+        return;
+    }
+    TraceEvent ev = ring->running[ring->depth];
+    ev.type   = static_cast<int>(FINISH);
+    ev.worker = worker;
+    push_event(ring, ev);
+}
+
+void Tracer::dump(std::ostream &os)
+{
+    long pid = static_cast<long>(getpid());
+    bool first = true;
+
+    s_rings_mutex.lock();
+    os << "{\"traceEvents\":[";
+    for (auto ring : *s_rings) {
+        size_t cap = ring->events.size();
+        unsigned long long head = ring->head.load(std::memory_order_acquire);
+        unsigned long long begin = (head > cap) ? head - cap : 0;
+        std::vector<TraceEvent> events;
+        events.reserve(head - begin);
+        for (unsigned long long i = begin; i < head; ++i) {
+            events.push_back(ring->events[i % cap]);
+        }
+
+        // Drop the ones overwritten by the owner thread while copying
+        unsigned long long end = ring->head.load(std::memory_order_acquire);
+        size_t skip = (end > cap && end - cap > begin) ? end - cap - begin : 0;
+
+        long worker = ring->worker.load(std::memory_order_relaxed);
+        os << (first ? "" : ",") << "{\"pid\":" << pid << ",\"tid\":" << ring->os_tid
+           << ",\"ph\":\"M\",\"name\":\"thread_name\",\"args\":{\"name\":\"";
+        if (worker >= 0) {
+            os << "worker " << worker;
+        } else {
+            os << "thread " << ring->os_tid;
+        }
+        os << "\"}}";
+        first = false;
+
+        for (size_t i = skip; i < events.size(); ++i) {
+            os << ',';
+            write_event(os, pid, *ring, events[i]);
+        }
+    }
+    os << "],\"displayTimeUnit\":\"ns\"}\n";
+    s_rings_mutex.unlock();
+}
+
+bool Tracer::dump(const char *path)
+{
+    std::ofstream ofs(path);
+    if (!ofs) {
+        return false;
+    }
+    dump(ofs);
+    return ofs.good();
+}
+
+END_NAMESPACE
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
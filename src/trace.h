@@ -0,0 +1,78 @@
+/**
+ * A thread pool framework
+ * Copyright 2017 (c), Oshyn Song (dualyangsong@gmail.com)
+ *
+ * @file    trace.h
+ * @author  Oshyn Song
+ * @time    2017.8
+ */
+#ifndef THREADPOOL_TRACE_H
+#define THREADPOOL_TRACE_H
+
+#include <atomic>
+#include <ostream>
+
+#include "common.h"
+#include "task.h"
+
+BEGIN_NAMESPACE
+
+/**
+ * Timeline of the task execution recorded into per-thread rings and
+ * dumped as Chrome trace JSON (chrome://tracing, ui.perfetto.dev)
+ */
+class Tracer {
+public:
+    enum EventType {
+        ENQUEUE,
+        DISPATCH,
+        START,
+        FINISH
+    };
+
+    // Start recording, each thread keeps its last `capacity` events. A new
+    // capacity is taken by each thread at its next event, dropping the old
+    // events. The tasks started before are never finished in the trace.
+    static void enable(size_t capacity = 64 * 1024);
+    static void disable();
+    static bool is_enabled()
+    {
+        return s_enabled.load(std::memory_order_relaxed);
+    }
+
+    // Worker is the index of the worker or -1 for the other threads
+    static void record(EventType type, const Task *task, long worker);
+
+    // Finish of the task started last and not finished by the calling
+    // thread, which may already be destructed when its run() returns.
+    // Nothing is recorded if there is none.
+    static void record_finish(long worker);
+
+    // The task names must still be valid when dumping
+    static void dump(std::ostream &os);
+    static bool dump(const char *path);
+
+private:
+    static std::atomic<bool>     s_enabled;
+    static std::atomic<size_t>   s_capacity;
+    static std::atomic<unsigned> s_epoch;  // Bumped by each enable()
+};
+
+// Costs only a relaxed load if tracing is disabled
+inline void trace_event(Tracer::EventType type, const Task *task, long worker)
+{
+    if (__builtin_expect(Tracer::is_enabled(), 0)) {
+        Tracer::record(type, task, worker);
+    }
+}
+
+inline void trace_finish(long worker)
+{
+    if (__builtin_expect(Tracer::is_enabled(), 0)) {
+        Tracer::record_finish(worker);
+    }
+}
+
+END_NAMESPACE
+#endif
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
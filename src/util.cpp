@@ -9,32 +9,213 @@
 
 #include "util.h"
 
+#include <algorithm>
+#include <iomanip>
+#include <map>
+#include <string>
+
 BEGIN_NAMESPACE
 
-Mutex::Mutex() : _mutex()
+struct timespec make_deadline(unsigned long long ms)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec  += static_cast<time_t>(ms / 1000);
+    ts.tv_nsec += static_cast<long>(ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec  += 1;
+        ts.tv_nsec -= 1000000000L;
+    }
+    return ts;
+}
+
+bool is_expired(const struct timespec &deadline)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (now.tv_sec > deadline.tv_sec ||
+            (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec));
+}
+
+unsigned long long get_monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<unsigned long long>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static void update_max(std::atomic<unsigned long long> &max, unsigned long long value)
+{
+    unsigned long long cur = max.load(std::memory_order_relaxed);
+    while (value > cur && !max.compare_exchange_weak(cur, value, std::memory_order_relaxed)) {
+        // Retry with the updated cur
+    }
+}
+
+// Definition of class Mutex
+struct LockCounters {
+    std::string                     name;
+    std::atomic<unsigned long long> acquisitions;
+    std::atomic<unsigned long long> contentions;
+    std::atomic<unsigned long long> wait_ns;
+    std::atomic<unsigned long long> max_wait_ns;
+    std::atomic<unsigned long long> hold_ns;
+    std::atomic<unsigned long long> max_hold_ns;
+};
+
+std::atomic<bool> Mutex::s_profiling(false);
+
+// Never freed, the counters are shared by the mutexes of the same name. The
+// registry itself uses the raw pthread mutex to stay out of the profiling.
+static pthread_mutex_t s_counters_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Named mutexes may be constructed before the statics of this file
+static std::map<std::string, LockCounters*> &get_counters()
+{
+    static std::map<std::string, LockCounters*> *s_counters =
+        new std::map<std::string, LockCounters*>();
+    return *s_counters;
+}
+
+Mutex::Mutex() : _mutex(), _counters(nullptr), _locked_ns(0)
 {
     pthread_mutex_init(&_mutex, nullptr);
 }
 
+Mutex::Mutex(const char *name) : Mutex()
+{
+    if (name == nullptr) {
+        return;
+    }
+
+    pthread_mutex_lock(&s_counters_mutex);
+    LockCounters *&counters = get_counters()[name];
+    if (counters == nullptr) {
+        counters = new LockCounters();
+        counters->name = name;
+    }
+    _counters = counters;
+    pthread_mutex_unlock(&s_counters_mutex);
+}
+
 Mutex::~Mutex()
 {
     pthread_mutex_destroy(&_mutex);
+    _counters = nullptr;
 }
 
 bool Mutex::lock()
 {
-    if (0 != pthread_mutex_trylock(&_mutex)) {
-        pthread_mutex_unlock(&_mutex);
+    if (_counters != nullptr && is_profiling()) {
+        return lock_profiled();
     }
-    return (0 == pthread_mutex_trylock(&_mutex));
+    return (0 == pthread_mutex_lock(&_mutex));
 }
 
 bool Mutex::unlock()
 {
+    if (_locked_ns != 0) {
+        end_hold();
+    }
     return (0 == pthread_mutex_unlock(&_mutex));
 }
 
-Condition::Condition(Mutex *mutex) : _cond(), _mutex(&(mutex->_mutex))
+bool Mutex::lock_profiled()
+{
+    unsigned long long wait_ns = 0;
+    if (0 != pthread_mutex_trylock(&_mutex)) {
+        unsigned long long begin = get_monotonic_ns();
+        if (0 != pthread_mutex_lock(&_mutex)) {
+            return false;
+        }
+        _locked_ns = get_monotonic_ns();
+        wait_ns = _locked_ns - begin;
+        ++_counters->contentions;
+        _counters->wait_ns += wait_ns;
+        update_max(_counters->max_wait_ns, wait_ns);
+    } else {
+        _locked_ns = get_monotonic_ns();
+    }
+    ++_counters->acquisitions;
+    return true;
+}
+
+// Reacquired by the condition wait, the wait for the signal is not a contention
+void Mutex::begin_hold()
+{
+    _locked_ns = get_monotonic_ns();
+    ++_counters->acquisitions;
+}
+
+void Mutex::end_hold()
+{
+    unsigned long long hold_ns = get_monotonic_ns() - _locked_ns;
+    _locked_ns = 0;
+    _counters->hold_ns += hold_ns;
+    update_max(_counters->max_hold_ns, hold_ns);
+}
+
+void Mutex::enable_profiling(bool enabled)
+{
+    s_profiling = enabled;
+}
+
+std::vector<LockStats> Mutex::get_stats()
+{
+    std::vector<LockStats> stats;
+
+    pthread_mutex_lock(&s_counters_mutex);
+    for (auto &item : get_counters()) {
+        LockCounters *c = item.second;
+        LockStats st;
+        st.name         = c->name.c_str();
+        st.acquisitions = c->acquisitions.load();
+        st.contentions  = c->contentions.load();
+        st.wait_ns      = c->wait_ns.load();
+        st.max_wait_ns  = c->max_wait_ns.load();
+        st.hold_ns      = c->hold_ns.load();
+        st.max_hold_ns  = c->max_hold_ns.load();
+        stats.push_back(st);
+    }
+    pthread_mutex_unlock(&s_counters_mutex);
+
+    std::sort(stats.begin(), stats.end(),
+            [](const LockStats &a, const LockStats &b) -> bool
+            {return a.wait_ns > b.wait_ns;});
+    return stats;
+}
+
+void Mutex::dump_stats(std::ostream &os)
+{
+    os << std::left << std::setw(24) << "name"
+       << std::right << std::setw(12) << "acquired" << std::setw(12) << "contended"
+       << std::setw(14) << "wait_us" << std::setw(14) << "max_wait_us"
+       << std::setw(14) << "hold_us" << std::setw(14) << "max_hold_us" << '\n';
+    for (auto &st : get_stats()) {
+        os << std::left << std::setw(24) << st.name
+           << std::right << std::setw(12) << st.acquisitions << std::setw(12) << st.contentions
+           << std::setw(14) << st.wait_ns / 1000 << std::setw(14) << st.max_wait_ns / 1000
+           << std::setw(14) << st.hold_ns / 1000 << std::setw(14) << st.max_hold_ns / 1000
+           << '\n';
+    }
+}
+
+void Mutex::reset_stats()
+{
+    pthread_mutex_lock(&s_counters_mutex);
+    for (auto &item : get_counters()) {
+        LockCounters *c = item.second;
+        c->acquisitions = 0;
+        c->contentions  = 0;
+        c->wait_ns      = 0;
+        c->max_wait_ns  = 0;
+        c->hold_ns      = 0;
+        c->max_hold_ns  = 0;
+    }
+    pthread_mutex_unlock(&s_counters_mutex);
+}
+
+Condition::Condition(Mutex *mutex) : _cond(), _mutex(mutex)
 {
     pthread_cond_init(&_cond, nullptr);
 }
@@ -49,7 +230,28 @@ Condition::~Condition()
 
 void Condition::wait()
 {
-    pthread_cond_wait(&_cond, _mutex);
+    // The mutex is not held while waiting for the condition
+    bool profiled = (_mutex->_locked_ns != 0);
+    if (profiled) {
+        _mutex->end_hold();
+    }
+    pthread_cond_wait(&_cond, &(_mutex->_mutex));
+    if (profiled) {
+        _mutex->begin_hold();
+    }
+}
+
+bool Condition::wait(const struct timespec &deadline)
+{
+    bool profiled = (_mutex->_locked_ns != 0);
+    if (profiled) {
+        _mutex->end_hold();
+    }
+    int status = pthread_cond_timedwait(&_cond, &(_mutex->_mutex), &deadline);
+    if (profiled) {
+        _mutex->begin_hold();
+    }
+    return (0 == status);
 }
 
 void Condition::signal()
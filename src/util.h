@@ -10,21 +10,76 @@
 #define THREADPOOL_UTIL_H
 
 #include <pthread.h>
+#include <time.h>
+
+#include <atomic>
+#include <ostream>
+#include <vector>
 
 #include "common.h"
 
 BEGIN_NAMESPACE
 
+// Absolute CLOCK_REALTIME deadline after the given milliseconds
+struct timespec make_deadline(unsigned long long ms);
+bool is_expired(const struct timespec &deadline);
+
+// CLOCK_MONOTONIC in nanoseconds
+unsigned long long get_monotonic_ns();
+
+// Hint the CPU inside the spinning loops
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+// Contention of the mutexes sharing the same name
+struct LockStats {
+    const char *       name;
+    unsigned long long acquisitions;
+    unsigned long long contentions;  // Acquired after waiting for another holder
+    unsigned long long wait_ns;
+    unsigned long long max_wait_ns;
+    unsigned long long hold_ns;
+    unsigned long long max_hold_ns;
+};
+
+struct LockCounters;
+
 class Mutex {
 public:
     friend class Condition;
     Mutex();
+
+    // Profiled under the name, the mutexes of the same name are summed up
+    explicit Mutex(const char *name);
     ~Mutex();
     bool lock();
     bool unlock();
 
+    // Profiling costs a relaxed load per lock when disabled
+    static void enable_profiling(bool enabled);
+    static bool is_profiling() { return s_profiling.load(std::memory_order_relaxed); }
+
+    // Sorted by the total waiting time
+    static std::vector<LockStats> get_stats();
+    static void dump_stats(std::ostream &os);
+    static void reset_stats();
+
 private:
-    pthread_mutex_t _mutex;
+    bool lock_profiled();
+    void begin_hold();
+    void end_hold();
+
+    pthread_mutex_t    _mutex;
+    LockCounters *     _counters;
+    unsigned long long _locked_ns;  // Only touched by the holder
+
+    static std::atomic<bool> s_profiling;
 };
 
 class Condition {
@@ -32,12 +87,15 @@ public:
     explicit Condition(Mutex *);
     ~Condition();
     void wait();
+
+    // Return false if the absolute CLOCK_REALTIME deadline is reached
+    bool wait(const struct timespec &deadline);
     void signal();
     void broadcast();
 
 private:
     pthread_cond_t   _cond;
-    pthread_mutex_t *_mutex;
+    Mutex *          _mutex;
 };
 
 class Semaphore {